@@ -0,0 +1,113 @@
+#include "kafka_utils/kafka_default_define.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <chrono>
+
+/**
+ * hash cost and key distribution skew of the hash partitioners
+ *
+ * usage: bench_hash_partitioner [key_count]
+ */
+namespace bench {
+
+    static std::vector<std::string> make_keys(int32_t key_count, size_t key_len) {
+        std::vector<std::string> keys;
+        keys.reserve(key_count);
+        for (int32_t i = 0; i < key_count; ++i) {
+            // "user-user-...0001234" like keys, distinct in the tail
+            std::string id = std::to_string(i);
+            std::string key;
+            while (key.size() + id.size() < key_len) {
+                key += "user-";
+            }
+            key.resize(key_len - id.size(), '0');
+            key += id;
+            keys.push_back(key);
+        }
+        return keys;
+    }
+
+    /** ns per partitioner_cb call */
+    static double hash_cost(RdKafka::PartitionerCb& partitioner, const std::vector<std::string>& keys, int32_t partition_cnt) {
+        int64_t sum = 0;
+        auto start_time = std::chrono::steady_clock::now();
+        for (int32_t round = 0; round < 10; ++round) {
+            for (auto& key : keys) {
+                sum += partitioner.partitioner_cb(nullptr, &key, partition_cnt, nullptr);
+            }
+        }
+        auto end_time = std::chrono::steady_clock::now();
+
+        // keep the calls from being optimized out
+        if (sum == -1) {
+            printf("%lld\n", (long long)sum);
+        }
+
+        return std::chrono::duration<double, std::nano>(end_time - start_time).count() / (keys.size() * 10.0);
+    }
+
+    /** max partition load / mean load, and the coefficient of variation */
+    static void skew(RdKafka::PartitionerCb& partitioner, const std::vector<std::string>& keys, int32_t partition_cnt,
+        double* max_over_mean, double* cv) {
+        std::vector<int64_t> counts(partition_cnt, 0);
+        for (auto& key : keys) {
+            ++counts[partitioner.partitioner_cb(nullptr, &key, partition_cnt, nullptr)];
+        }
+
+        double mean = (double)keys.size() / partition_cnt;
+        double max_count = 0;
+        double variance = 0;
+        for (auto count : counts) {
+            if (count > max_count) {
+                max_count = (double)count;
+            }
+            variance += (count - mean) * (count - mean);
+        }
+        variance /= partition_cnt;
+
+        *max_over_mean = max_count / mean;
+        *cv = sqrt(variance) / mean;
+    }
+
+    static void run(const char* name, RdKafka::PartitionerCb& partitioner, int32_t key_count) {
+        const size_t key_lens[] = { 8, 16, 64, 256 };
+        const int32_t partition_cnts[] = { 3, 12, 64, 256 };
+
+        for (auto key_len : key_lens) {
+            std::vector<std::string> keys = make_keys(key_count, key_len);
+
+            printf("%-10s key_len[%3d] cost[%6.1f ns]", name, (int32_t)key_len, hash_cost(partitioner, keys, 12));
+            for (auto partition_cnt : partition_cnts) {
+                double max_over_mean = 0;
+                double cv = 0;
+                skew(partitioner, keys, partition_cnt, &max_over_mean, &cv);
+                printf("  p%-3d max/mean[%.3f] cv[%.4f]", partition_cnt, max_over_mean, cv);
+            }
+            printf("\n");
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int32_t key_count = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    utility::murmur2_partitioner murmur2;
+    utility::crc32c_partitioner crc32c;
+    utility::xxhash32_partitioner xxhash32;
+    utility::djb_partitioner djb;
+    utility::custom_hash_partitioner custom_djb;
+
+    printf("key_count[%d] crc32c hardware[%s]\n", key_count, utility::crc32c_hash::hardware_accelerated() ? "yes" : "no");
+
+    bench::run("murmur2", murmur2, key_count);
+    bench::run("crc32c", crc32c, key_count);
+    bench::run("xxhash32", xxhash32, key_count);
+    bench::run("djb", djb, key_count);
+    bench::run("djb(func)", custom_djb, key_count);
+
+    return 0;
+}
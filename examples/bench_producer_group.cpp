@@ -0,0 +1,130 @@
+#include "kafka_utils/kafka_producer_group.h"
+#include "kafka_utils/kafka_producer_event_handler.h"
+#include "kafka_utils/kafka_default_define.hpp"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+/**
+ * enqueue throughput of kafka_producer_group with 1..N shards
+ *
+ * usage: bench_producer_group broker_list topic [thread_count] [msg_count_per_thread] [max_shard_count] [msg_size]
+ */
+namespace bench {
+
+    class delivery_counter : public utility::kafka_producer_event_handler {
+    public:
+        std::atomic<int64_t>    delivered;
+        std::atomic<int64_t>    failed;
+
+        delivery_counter() : delivered(0), failed(0) {}
+
+    public:
+        virtual void    on_produce_msg_delivered(RdKafka::Message& message) override {
+            if (message.err() == RdKafka::ERR_NO_ERROR) {
+                ++delivered;
+            }
+            else {
+                ++failed;
+            }
+        }
+    };
+
+    struct bench_result {
+        double  enqueue_msgs_per_sec;
+        double  delivered_msgs_per_sec;
+        int64_t failed_count;
+        int64_t blocked_time_us;
+    };
+
+    bench_result run(const std::string& broker_list, const std::string& topic_name, int32_t shard_count,
+        int32_t thread_count, int32_t msg_count_per_thread, int32_t msg_size) {
+
+        utility::round_robin_partitioner partitioner;
+        delivery_counter counter;
+
+        utility::kafka_producer_options options;
+        options.broker_list = broker_list;
+        options.partitioner_cb = &partitioner;
+        options.backpressure_policy = utility::backpressure_block;
+
+        utility::kafka_producer_group group(options, shard_count, 1, utility::shard_by_thread);
+        group.set_event_handler(&counter);
+        group.start();
+
+        std::string payload(msg_size, 'x');
+        std::atomic<int64_t> produce_failed(0);
+
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> threads;
+        for (int32_t t = 0; t < thread_count; ++t) {
+            threads.push_back(std::thread([&, t] {
+                std::string key = std::to_string(t);
+                for (int32_t i = 0; i < msg_count_per_thread; ++i) {
+                    if (!group.produce_msg(topic_name, payload, &key, nullptr)) {
+                        ++produce_failed;
+                    }
+                }
+            }));
+        }
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        auto enqueue_time = std::chrono::steady_clock::now();
+
+        int64_t total = (int64_t)thread_count * msg_count_per_thread - produce_failed.load();
+        while (counter.delivered.load() + counter.failed.load() < total) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        auto end_time = std::chrono::steady_clock::now();
+
+        group.stop();
+        group.wait_for_stop();
+
+        double enqueue_sec = std::chrono::duration<double>(enqueue_time - start_time).count();
+        double total_sec = std::chrono::duration<double>(end_time - start_time).count();
+
+        bench_result result;
+        result.enqueue_msgs_per_sec = total / enqueue_sec;
+        result.delivered_msgs_per_sec = counter.delivered.load() / total_sec;
+        result.failed_count = counter.failed.load() + produce_failed.load();
+        result.blocked_time_us = group.get_backpressure_stats().total_blocked_time_us;
+        return result;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        printf("usage: %s broker_list topic [thread_count] [msg_count_per_thread] [max_shard_count] [msg_size]\n", argv[0]);
+        return 1;
+    }
+
+    std::string broker_list = argv[1];
+    std::string topic_name = argv[2];
+    int32_t thread_count = argc > 3 ? atoi(argv[3]) : 16;
+    int32_t msg_count_per_thread = argc > 4 ? atoi(argv[4]) : 100000;
+    int32_t max_shard_count = argc > 5 ? atoi(argv[5]) : 8;
+    int32_t msg_size = argc > 6 ? atoi(argv[6]) : 1024;
+
+    printf("threads[%d] msgs_per_thread[%d] msg_size[%d]\n", thread_count, msg_count_per_thread, msg_size);
+    printf("%-8s %-16s %-16s %-10s %-12s\n", "shards", "enqueue msg/s", "delivered msg/s", "failed", "blocked ms");
+
+    for (int32_t shard_count = 1; shard_count <= max_shard_count; shard_count *= 2) {
+        bench::bench_result result = bench::run(broker_list, topic_name, shard_count, 
+            thread_count, msg_count_per_thread, msg_size);
+
+        printf("%-8d %-16.0f %-16.0f %-10lld %-12lld\n", shard_count, result.enqueue_msgs_per_sec, 
+            result.delivered_msgs_per_sec, (long long)result.failed_count, (long long)(result.blocked_time_us / 1000));
+    }
+
+    return 0;
+}
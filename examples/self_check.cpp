@@ -0,0 +1,450 @@
+#include "kafka_utils/kafka_default_define.hpp"
+#include "kafka_utils/kafka_latency_histogram.hpp"
+#include "kafka_utils/kafka_spill_log.h"
+#include "kafka_utils/kafka_rate_limiter.hpp"
+#include "kafka_utils/kafka_envelope.hpp"
+#include "kafka_utils/kafka_consumer.h"
+#include "kafka_utils/kafka_producer.h"
+#include "kafka_utils/kafka_spsc_queue.hpp"
+#include "kafka_utils/kafka_offset_tracker.hpp"
+#include <rdkafka.h>
+#include <rdkafka_mock.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+/**
+ * self checks that need no broker, the consumer ones run against the in-process mock cluster of librdkafka;
+ * exits with 1 if any check fails
+ *
+ * usage: self_check [spill_dir]
+ */
+namespace check {
+
+    static int32_t failed_count = 0;
+
+    static void expect(bool ok, const char* what) {
+        if (!ok) {
+            ++failed_count;
+        }
+        printf("  %-60s %s\n", what, ok ? "ok" : "FAILED");
+    }
+
+    static void murmur2() {
+        printf("murmur2_hash\n");
+
+        // org.apache.kafka.common.utils.UtilsTest.testMurmur2, made positive as the java partitioner does
+        struct java_case {
+            const char* data;
+            int32_t     hash;
+        };
+        const java_case cases[] = {
+            { "21", -973932308 },
+            { "foobar", -790332482 },
+            { "a-little-bit-long-string", -985981536 },
+            { "a-little-bit-longer-string", -1486304829 },
+            { "lkjh234lh9fiuh90y23oiuhsafujhadof229phr9h19h89h8", -58897971 },
+            { "abc", 479470107 },
+        };
+
+        utility::murmur2_hash hash;
+        for (auto& java : cases) {
+            std::string what = std::string("\"") + java.data + "\"";
+            expect(hash(java.data, strlen(java.data)) == ((uint32_t)java.hash & 0x7fffffff), what.c_str());
+        }
+
+        // same partitions as the java client
+        utility::murmur2_partitioner partitioner;
+        std::string key = "foobar";
+        expect(partitioner.partitioner_cb(nullptr, &key, 12, nullptr) == (int32_t)(((uint32_t)-790332482 & 0x7fffffff) % 12),
+            "murmur2_partitioner places \"foobar\"");
+
+        utility::crc32c_hash crc32c;
+        expect(crc32c("123456789", 9) == 0xe3069283, "crc32c check value");
+    }
+
+    static void latency_histogram() {
+        printf("kafka_latency_histogram\n");
+        utility::kafka_latency_histogram histogram;
+        for (int64_t latency = 1; latency <= 10000; ++latency) {
+            histogram.record(latency);
+        }
+
+        // the percentiles are bucket upper bounds, within about 3%
+        utility::kafka_latency_snapshot snap = histogram.snapshot();
+        expect(snap.count == 10000 && snap.min_us == 1 && snap.max_us == 10000, "count, min, max");
+        expect(snap.mean_us == 5000, "mean");
+        expect(snap.p50_us >= 5000 && snap.p50_us <= 5000 * 1.04, "p50 within 4%");
+        expect(snap.p99_us >= 9900 && snap.p99_us <= 10000, "p99 within 4%");
+        expect(snap.p999_us >= 9990 && snap.p999_us <= 10000, "p999 capped by max");
+
+        bool bounded = true;
+        for (int64_t value = 0; value < ((int64_t)1 << 30); value = value * 3 / 2 + 1) {
+            int32_t index = utility::kafka_latency_histogram::bucket_index(value);
+            bounded = utility::kafka_latency_histogram::bucket_upper_bound(index) >= value && bounded;
+            bounded = (index == 0 || utility::kafka_latency_histogram::bucket_upper_bound(index - 1) < value) && bounded;
+        }
+        expect(bounded, "every value falls in the bucket bounding it");
+
+        utility::kafka_latency_histogram other;
+        other.record(20000);
+        histogram.merge(other);
+        snap = histogram.snapshot();
+        expect(snap.count == 10001 && snap.max_us == 20000, "merge adds the records of another histogram");
+
+        histogram.reset();
+        expect(histogram.snapshot().count == 0, "reset");
+    }
+
+    static std::string segment_path(const std::string& dir, int64_t id) {
+        std::string name = std::to_string(id);
+        name.insert(0, 20 - name.size(), '0');
+        return dir + "/" + name + ".spill";
+    }
+
+    /** flips a byte of the first occurrence of text in the file */
+    static bool corrupt_file(const std::string& path, const std::string& text) {
+        FILE* file = fopen(path.c_str(), "r+b");
+        if (!file) {
+            return false;
+        }
+
+        std::string data;
+        char buf[65536];
+        size_t read_len = 0;
+        while ((read_len = fread(buf, 1, sizeof(buf), file)) > 0) {
+            data.append(buf, read_len);
+        }
+
+        size_t pos = data.find(text);
+        bool ok = pos != std::string::npos
+            && fseek(file, (long)pos, SEEK_SET) == 0
+            && fputc(data[pos] ^ 0x20, file) != EOF;
+        fclose(file);
+        return ok;
+    }
+
+    static void spill_log(const std::string& dir) {
+        printf("kafka_spill_log (%s)\n", dir.c_str());
+        std::string err;
+        {
+            utility::kafka_spill_log log(dir, 1 << 20, 0);
+            expect(log.open(&err), "open a new spill dir");
+
+            std::string key = "key-1";
+            expect(log.append("topic_a", 3, key.c_str(), key.size(), "alpha-payload", 13)
+                && log.append("topic_b", -1, nullptr, 0, "beta-payload", 12, true)
+                && log.append("topic_a", 0, nullptr, 0, "gamma-payload", 13), "append 3 records");
+            expect(log.get_stats().pending_count == 3, "3 pending");
+        }
+
+        {
+            // the records survive the process, as a restart replays them
+            utility::kafka_spill_log log(dir, 1 << 20, 0);
+            expect(log.open(&err) && log.get_stats().pending_count == 3, "reopen finds 3 pending");
+
+            utility::kafka_spill_record record;
+            expect(log.peek(&record) && record.topic_name == "topic_a" && record.partition == 3
+                && record.has_key && record.key == "key-1" && record.payload == "alpha-payload" && !record.envelope,
+                "replay the keyed record");
+            log.pop(true);
+
+            expect(log.peek(&record) && record.topic_name == "topic_b" && record.partition == -1
+                && !record.has_key && record.payload == "beta-payload" && record.envelope,
+                "replay the envelope record");
+            expect(log.get_stats().replayed_count == 1, "pop counts the replay");
+        }
+
+        expect(corrupt_file(segment_path(dir, 0), "gamma-payload"), "corrupt the body of the last record");
+
+        {
+            // the crc check stops the recovery at the corrupted record, as at a torn write
+            utility::kafka_spill_log log(dir, 1 << 20, 0);
+            expect(log.open(&err) && log.get_stats().pending_count == 1, "reopen keeps only the intact record");
+
+            utility::kafka_spill_record record;
+            expect(log.peek(&record) && record.payload == "beta-payload", "replay resumes after the popped record");
+            log.pop(true);
+
+            expect(!log.peek(&record) && log.empty(), "the corrupted record is not replayed");
+        }
+
+        remove(segment_path(dir, 0).c_str());
+    }
+
+    static void rate_limiter() {
+        printf("kafka_token_bucket(GCRA)\n");
+        const int64_t ms = 1000000;
+        int64_t now = 1000 * ms;
+
+        // 1000 tokens per second, 10 in the bucket
+        utility::kafka_token_bucket bucket(1000, 10);
+        bool acquired = true;
+        for (int32_t i = 0; i < 10; ++i) {
+            acquired = bucket.try_acquire(1, now) == 0 && acquired;
+        }
+        expect(acquired, "the burst of 10 passes at once");
+        expect(bucket.try_acquire(1, now) == 1 * ms, "the 11th waits 1ms");
+        expect(bucket.try_acquire(1, now + 1 * ms) == 0, "and passes 1ms later");
+
+        bucket.refund(1);
+        expect(bucket.try_acquire(1, now + 1 * ms) == 0, "a refunded token is taken again");
+        expect(bucket.tokens(now + 1000 * ms) > 9.99, "the bucket refills to 10");
+
+        expect(bucket.try_acquire(50, now + 1000 * ms) == 0, "a request bigger than the full bucket passes");
+        expect(bucket.try_acquire(1, now + 1000 * ms) > 0, "and leaves the bucket in debt");
+
+        utility::kafka_token_bucket unlimited(0, 0);
+        expect(unlimited.unlimited() && unlimited.try_acquire(1000000, now) == 0, "rate 0 is unlimited");
+    }
+
+    static void envelope() {
+        printf("kafka_envelope\n");
+        std::vector<std::string> records;
+        records.push_back("a");
+        records.push_back("");
+        records.push_back(std::string(200, 'x'));      // a two byte length prefix
+        records.push_back(std::string(70000, 'y'));    // a three byte length prefix
+
+        std::string buffer;
+        size_t size = 0;
+        utility::kafka_envelope::begin(buffer);
+        for (auto& record : records) {
+            utility::kafka_envelope::append(buffer, record.c_str(), (uint32_t)record.size());
+            size += utility::kafka_envelope::record_size((uint32_t)record.size());
+        }
+        expect(buffer.size() == utility::kafka_envelope::magic_size + size, "record_size adds up to the envelope size");
+
+        std::vector<std::string> unpacked;
+        bool ok = utility::kafka_envelope::unpack(buffer.c_str(), buffer.size(), [&](const char* record, int32_t len) {
+            unpacked.push_back(std::string(record, len));
+        });
+        expect(ok && unpacked == records, "unpack returns the records in order");
+
+        expect(!utility::kafka_envelope::is_envelope(buffer.c_str(), buffer.size() - 1), "a truncated envelope is rejected");
+        expect(!utility::kafka_envelope::is_envelope("plain message", 13), "a plain message is not an envelope");
+
+        std::string magic_only;
+        utility::kafka_envelope::begin(magic_only);
+        expect(!utility::kafka_envelope::is_envelope(magic_only.c_str(), magic_only.size()), "an empty envelope is rejected");
+    }
+
+    template<class Cond>
+    static bool wait_until(Cond cond, int32_t timeout_ms) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (!cond()) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return true;
+    }
+
+    /** the batch mode end to end, against the in-process mock cluster of librdkafka */
+    static void batch_consume() {
+        printf("kafka_consumer batch mode\n");
+
+        char errstr[512];
+        rd_kafka_t* rk = rd_kafka_new(RD_KAFKA_PRODUCER, rd_kafka_conf_new(), errstr, sizeof(errstr));
+        rd_kafka_mock_cluster_t* mcluster = rk ? rd_kafka_mock_cluster_new(rk, 1) : nullptr;
+        expect(mcluster != nullptr, "start the mock cluster");
+        if (!mcluster) {
+            if (rk) {
+                rd_kafka_destroy(rk);
+            }
+            return;
+        }
+
+        const int32_t batch_size = 4;
+        const int32_t msg_count = 20;
+        std::vector<std::string> topic_list;
+        topic_list.push_back("self_check_a");
+        topic_list.push_back("self_check_b");
+        for (auto& topic_name : topic_list) {
+            rd_kafka_mock_topic_create(mcluster, topic_name.c_str(), 1, 1);
+        }
+
+        struct batch_call {
+            std::string                 topic_name;
+            std::vector<std::string>    payloads;
+        };
+        std::mutex mtx;
+        std::vector<batch_call> calls;
+        auto handler = [&](const std::string& topic_name, const utility::kafka_msg_view* msgs, int32_t count) {
+            batch_call call;
+            call.topic_name = topic_name;
+            for (int32_t i = 0; i < count; ++i) {
+                call.payloads.push_back(std::string(msgs[i].payload, msgs[i].len));
+            }
+
+            std::lock_guard<std::mutex> locker(mtx);
+            calls.push_back(std::move(call));
+        };
+        auto received = [&]() {
+            std::lock_guard<std::mutex> locker(mtx);
+            size_t count = 0;
+            for (auto& call : calls) {
+                count += call.payloads.size();
+            }
+            return count;
+        };
+
+        utility::kafka_producer_options producer_options;
+        producer_options.broker_list = rd_kafka_mock_cluster_bootstraps(mcluster);
+
+        utility::kafka_consumer_options consumer_options;
+        consumer_options.broker_list = producer_options.broker_list;
+        consumer_options.group_id = "self_check";
+        consumer_options.batch_size = batch_size;
+        consumer_options.batch_timeout_ms = 300;
+
+        {
+            utility::kafka_producer producer(producer_options);
+            producer.start();
+
+            utility::kafka_consumer consumer(consumer_options, 1);
+            std::vector<utility::kafka_consumer::consume_batch_handler> handler_list(topic_list.size(), handler);
+            consumer.subscribe_batch(topic_list, handler_list);
+            consumer.start();
+
+            std::string err;
+            bool produced = true;
+            for (int32_t i = 0; i < msg_count; ++i) {
+                for (auto& topic_name : topic_list) {
+                    produced = producer.produce_msg(topic_name, 0, topic_name + "#" + std::to_string(i), nullptr, &err) && produced;
+                }
+            }
+            expect(produced, "produce 20 messages to each of 2 topics");
+            expect(wait_until([&] { return received() >= topic_list.size() * msg_count; }, 30000), "all 40 handed to the batch handlers");
+
+            std::unique_lock<std::mutex> locker(mtx);
+            bool own_topic = true;
+            bool in_order = true;
+            size_t max_count = 0;
+            std::map<std::string, int32_t> next_index;
+            for (auto& call : calls) {
+                max_count = (std::max)(max_count, call.payloads.size());
+                for (auto& payload : call.payloads) {
+                    std::string prefix = call.topic_name + "#";
+                    own_topic = payload.compare(0, prefix.size(), prefix) == 0 && own_topic;
+                    in_order = payload == prefix + std::to_string(next_index[call.topic_name]++) && in_order;
+                }
+            }
+            expect(own_topic, "each call holds the messages of its own topic only");
+            expect(in_order, "in order per partition");
+            expect(max_count > 1 && max_count <= (size_t)batch_size, "handed over in batches of up to batch_size");
+            size_t call_count = calls.size();
+            locker.unlock();
+
+            // a lone message can not fill the batch, batch_timeout_ms hands it over
+            expect(producer.produce_msg(topic_list[0], 0, topic_list[0] + "#tail", nullptr, &err), "produce one more message");
+            expect(wait_until([&] {
+                std::lock_guard<std::mutex> locker(mtx);
+                return calls.size() > call_count;
+            }, 30000), "a batch short of batch_size is handed over at batch_timeout_ms");
+
+            locker.lock();
+            expect(calls.size() == call_count + 1 && calls.back().payloads.size() == 1 
+                && calls.back().payloads[0] == topic_list[0] + "#tail", "it holds the lone message only");
+        }
+
+        rd_kafka_mock_cluster_destroy(mcluster);
+        rd_kafka_destroy(rk);
+    }
+
+    static void spsc_queue() {
+        printf("kafka_spsc_queue\n");
+        utility::kafka_spsc_queue<int64_t> queue(5);
+        expect(queue.capacity() == 8, "capacity rounds up to 8");
+
+        bool pushed = true;
+        for (int64_t i = 0; i < 8; ++i) {
+            pushed = queue.try_push(i) && pushed;
+        }
+        expect(pushed && !queue.try_push(8), "full after 8 pushes");
+
+        bool in_order = true;
+        int64_t value = 0;
+        for (int64_t i = 0; i < 8; ++i) {
+            in_order = queue.try_pop(&value) && value == i && in_order;
+        }
+        expect(in_order && !queue.try_pop(&value) && queue.empty(), "pops in order until empty");
+
+        const int64_t count = 1000000;
+        std::thread producer([&] {
+            for (int64_t i = 0; i < count; ++i) {
+                while (!queue.try_push(i)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+
+        int64_t expected = 0;
+        while (expected < count) {
+            if (!queue.try_pop(&value)) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            if (value != expected) {
+                break;
+            }
+            ++expected;
+        }
+        producer.join();
+        expect(expected == count, "1000000 values across two threads in order");
+    }
+
+    static void offset_tracker() {
+        printf("kafka_offset_tracker\n");
+        utility::kafka_offset_tracker tracker(128);
+
+        bool tracked = true;
+        for (int64_t offset = 100; offset < 110; ++offset) {
+            tracked = tracker.track(offset) && tracked;
+        }
+        expect(tracked, "track 100..109");
+        expect(tracker.committed_offset() == 100, "nothing completed commits 100");
+
+        expect(tracker.complete(101) && tracker.complete(102), "complete 101, 102");
+        expect(tracker.committed_offset() == 100, "gap at 100 holds the commit");
+        expect(tracker.complete(100), "complete 100");
+        expect(tracker.committed_offset() == 103, "commit moves to 103");
+
+        expect(!tracker.complete(101), "duplicate ack is rejected");
+        expect(!tracker.complete(99), "ack below the commit is rejected");
+        expect(!tracker.complete(200), "ack of an untracked offset is rejected");
+        expect(!tracker.track(300), "track beyond the window waits for 103");
+
+        for (int64_t offset = 103; offset < 110; ++offset) {
+            tracker.complete(offset);
+        }
+        expect(tracker.idle() && tracker.committed_offset() == 110, "all completed commits 110");
+        expect(tracker.track(300) && tracker.committed_offset() == 300, "idle tracker restarts at 300");
+    }
+}
+
+int main(int argc, char** argv) {
+    std::string spill_dir = argc > 1 ? argv[1] : "self_check_spill_" + std::to_string((int64_t)time(NULL));
+
+    check::murmur2();
+    check::latency_histogram();
+    check::spill_log(spill_dir);
+    check::rate_limiter();
+    check::envelope();
+    check::batch_consume();
+    check::spsc_queue();
+    check::offset_tracker();
+
+    printf("%s, %d check(s) failed\n", check::failed_count == 0 ? "passed" : "FAILED", check::failed_count);
+    return check::failed_count == 0 ? 0 : 1;
+}
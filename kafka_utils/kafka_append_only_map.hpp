@@ -0,0 +1,123 @@
+﻿/**
+ * @brief append only map with lock-free lookup
+ *
+ * values are never removed nor moved once inserted, so the pointers 
+ * returned stay valid until the map is destroyed
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-20
+ */
+
+#ifndef __utility_common_kafka_append_only_map_hpp__
+#define __utility_common_kafka_append_only_map_hpp__
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+namespace utility
+{
+
+template<typename Key, typename Value, typename Hash = std::hash<Key> >
+class kafka_append_only_map
+{
+public:
+    typedef std::function<Value*(const Key&)> value_factory;
+
+protected:
+    typedef std::unordered_map<Key, Value*, Hash> map_type;
+
+    std::atomic<const map_type*>    m_snapshot;
+    std::mutex                      m_mtx;
+    /** replaced snapshots, readers may still hold them, freed with the map */
+    std::vector<const map_type*>    m_retired_snapshots;
+    std::vector<Value*>             m_values;
+
+public:
+    kafka_append_only_map() : m_snapshot(new map_type()) {
+    }
+
+    ~kafka_append_only_map() {
+        delete m_snapshot.load();
+
+        for (auto snapshot : m_retired_snapshots) {
+            delete snapshot;
+        }
+
+        for (auto value : m_values) {
+            delete value;
+        }
+    }
+
+    kafka_append_only_map(const kafka_append_only_map&) = delete;
+    kafka_append_only_map& operator=(const kafka_append_only_map&) = delete;
+
+public:
+    /** lock-free lookup, returns nullptr if the key is not inserted yet */
+    Value*  find(const Key& key) const {
+        const map_type* snapshot = m_snapshot.load(std::memory_order_acquire);
+        auto iter = snapshot->find(key);
+        if (iter != snapshot->end()) {
+            return iter->second;
+        }
+
+        return nullptr;
+    }
+
+    /** lookup the key, create it by factory if absent; a nullptr from factory is not inserted */
+    Value*  get_or_create(const Key& key, const value_factory& factory) {
+        Value* value = find(key);
+        if (value) {
+            return value;
+        }
+
+        std::lock_guard<std::mutex> locker(m_mtx);
+
+        const map_type* snapshot = m_snapshot.load(std::memory_order_relaxed);
+        auto iter = snapshot->find(key);
+        if (iter != snapshot->end()) {
+            return iter->second;
+        }
+
+        value = factory(key);
+        if (!value) {
+            return nullptr;
+        }
+
+        m_values.push_back(value);
+
+        map_type* new_snapshot = new map_type(*snapshot);
+        (*new_snapshot)[key] = value;
+        m_snapshot.store(new_snapshot, std::memory_order_release);
+        m_retired_snapshots.push_back(snapshot);
+
+        return value;
+    }
+
+    /** all the values in insertion order */
+    std::vector<Value*> values() {
+        std::lock_guard<std::mutex> locker(m_mtx);
+        return m_values;
+    }
+
+    /** value by insertion index, nullptr if out of range */
+    Value*  at(int32_t index) {
+        std::lock_guard<std::mutex> locker(m_mtx);
+        if (index < 0 || index >= (int32_t)m_values.size()) {
+            return nullptr;
+        }
+
+        return m_values[index];
+    }
+
+    int32_t size() {
+        std::lock_guard<std::mutex> locker(m_mtx);
+        return (int32_t)m_values.size();
+    }
+};
+
+} // end namespace utility
+
+#endif
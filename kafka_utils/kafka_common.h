@@ -13,4 +13,35 @@
 #define LIBRDKAFKA_STATICLIB
 #endif
 
+#include <stdint.h>
+
+namespace utility
+{
+
+/** result of the shutdown of a producer or consumer */
+struct kafka_shutdown_report
+{
+    bool        completed;              /** everything was flushed or handled and committed before the timeout */
+    int64_t     elapsed_ms;
+    /** producer: messages not delivered before the timeout, purged from the local queue and reported as failed (spilled in spill mode) */
+    int32_t     undelivered_count;
+    /** producer: messages spilled during the shutdown, replayed by the next producer on the same spill_dir */
+    int64_t     spilled_count;
+    /** consumer: messages consumed but not handled, they are consumed again after the restart */
+    int32_t     unhandled_count;
+    /** consumer: error code of the final commit or the close, 0 if both succeeded */
+    int32_t     commit_error;
+
+    kafka_shutdown_report()
+        : completed(false)
+        , elapsed_ms(0)
+        , undelivered_count(0)
+        , spilled_count(0)
+        , unhandled_count(0)
+        , commit_error(0){
+    }
+};
+
+} // end namespace utility
+
 #endif
\ No newline at end of file
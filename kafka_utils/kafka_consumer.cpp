@@ -2,6 +2,16 @@
 #include "kafka_consumer_event_handler.h"
 #include "kafka_thread_pool.hpp"
 #include "kafka_ip_utils.hpp"
+#include "kafka_envelope.hpp"
+#include "kafka_spsc_queue.hpp"
+#include "kafka_offset_tracker.hpp"
+#include "kafka_hash.hpp"
+#include <rdkafka.h>
+#include <string.h>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <condition_variable>
 
 #ifdef _WIN32
 #define snprintf _snprintf
@@ -10,12 +20,123 @@
 namespace utility
 {
 
+static int64_t steady_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t topic_name_hash(const char* topic_name) {
+    // FNV-1a 64
+    uint64_t hash = 14695981039346656037ull;
+    for (const char* p = topic_name; *p; ++p) {
+        hash ^= (uint8_t)*p;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static inline uint64_t partition_key(const char* topic_name, int32_t partition) {
+    // a collision would put two partitions on the same worker and tracker, not worth a compare at 64 bits
+    return topic_name_hash(topic_name) * 31 + (uint32_t)partition;
+}
+
+/** a message on its way to a work thread, tracker is set with dispatch_by_key */
+struct dispatch_item {
+    RdKafka::Message*       message;
+    kafka_offset_tracker*   tracker;
+};
+
+struct kafka_consumer::dispatch_worker {
+    kafka_spsc_queue<dispatch_item>     queue;
+    kafka_thread_pool*                  thread_pool;
+    std::mutex                          mtx;
+    std::condition_variable             cv;
+    std::atomic<bool>                   sleeping;
+    /** set by stop, wakes the worker at once */
+    std::atomic<bool>                   stopping;
+    /** pushed by the poll thread, done by the worker; equal when the worker is idle */
+    std::atomic<uint64_t>               pushed_count;
+    std::atomic<uint64_t>               done_count;
+    /** partitions pinned to the worker, used by the poll thread only */
+    int32_t                             pinned_count;
+
+    dispatch_worker(size_t queue_size)
+        : queue(queue_size)
+        , thread_pool(nullptr)
+        , sleeping(false)
+        , stopping(false)
+        , pushed_count(0)
+        , done_count(0)
+        , pinned_count(0){
+    }
+};
+
+struct kafka_consumer::partition_offsets {
+    std::string             topic_name;
+    int32_t                 partition;
+    kafka_offset_tracker    tracker;
+    /** last offset given to offsets_store or commit, the next one may be lower after a seek */
+    int64_t                 stored_offset;
+
+    partition_offsets(const char* topic, int32_t part, int32_t max_pending)
+        : topic_name(topic)
+        , partition(part)
+        , tracker(max_pending)
+        , stored_offset(-1){
+    }
+};
+
+void kafka_consumer::topic_handler_table::build() {
+    size_t slot_count = 8;
+    while (slot_count < handlers.size() * 2) {
+        slot_count <<= 1;
+    }
+
+    slots.assign(slot_count, -1);
+    for (int32_t i = 0; i < (int32_t)handlers.size(); ++i) {
+        handlers[i].name_hash = topic_name_hash(handlers[i].topic_name.c_str());
+
+        size_t slot = handlers[i].name_hash & (slot_count - 1);
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = i;
+    }
+}
+
+const kafka_consumer::topic_handler* kafka_consumer::topic_handler_table::find(const char* topic_name) const {
+    uint64_t hash = topic_name_hash(topic_name);
+    size_t mask = slots.size() - 1;
+
+    for (size_t slot = hash & mask; slots[slot] >= 0; slot = (slot + 1) & mask) {
+        const topic_handler& handler = handlers[slots[slot]];
+        if (handler.name_hash == hash && strcmp(handler.topic_name.c_str(), topic_name) == 0) {
+            return &handler;
+        }
+    }
+
+    return nullptr;
+}
+
 kafka_consumer::kafka_consumer(const kafka_consumer_options& options, int32_t work_thread_count)
     : m_event_handler(nullptr)
     , m_options(options)
     , m_global_conf(nullptr)
     , m_default_topic_conf(nullptr)
-    , m_total_partition_count(0){
+    , m_total_partition_count(0)
+    , m_handler_table(nullptr)
+    , m_uncommitted_acks(0)
+    , m_final_committed(false)
+    , m_closed(false)
+    , m_next_flush_ms(0)
+    , m_next_worker(0)
+    , m_stopping(false)
+    , m_stop_deadline_ms(0)
+    , m_dropped_count(0){
+
+    topic_handler_table* handler_table = new topic_handler_table();
+    handler_table->build();
+    m_handler_table = handler_table;
 
     m_global_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
     m_default_topic_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_TOPIC);
@@ -41,13 +162,54 @@ kafka_consumer::kafka_consumer(const kafka_consumer_options& options, int32_t wo
         m_global_conf->set("debug", m_options.debug, err_string);
     }
 
+    if (!m_options.assignment_strategy.empty()) {
+        m_global_conf->set("partition.assignment.strategy", m_options.assignment_strategy, err_string);
+    }
+
+    if (!m_options.group_instance_id.empty()) {
+        m_global_conf->set("group.instance.id", m_options.group_instance_id, err_string);
+    }
+
+    if (m_options.session_timeout_ms > 0) {
+        m_global_conf->set("session.timeout.ms", std::to_string(m_options.session_timeout_ms), err_string);
+    }
+
+    if (m_options.heartbeat_interval_ms > 0) {
+        m_global_conf->set("heartbeat.interval.ms", std::to_string(m_options.heartbeat_interval_ms), err_string);
+    }
+
+    if (m_options.max_poll_interval_ms > 0) {
+        m_global_conf->set("max.poll.interval.ms", std::to_string(m_options.max_poll_interval_ms), err_string);
+    }
+
     m_global_conf->set("default_topic_conf", m_default_topic_conf, err_string);
     m_global_conf->set("dr_cb", (RdKafka::DeliveryReportCb*)this, err_string);
     m_global_conf->set("event_cb", (RdKafka::EventCb*)this, err_string);
     m_global_conf->set("rebalance_cb", (RdKafka::RebalanceCb*)this, err_string);
 
+    if (offsets_tracked()) {
+        // the offsets are stored by the consuming thread once every message before them is handled
+        m_global_conf->set("enable.auto.offset.store", "false", err_string);
+    }
+
+    if (m_options.manual_commit) {
+        m_global_conf->set("enable.auto.commit", "false", err_string);
+    }
+
     m_consumer = RdKafka::KafkaConsumer::create(m_global_conf, err_string);
-    m_work_thread_pool = new kafka_thread_pool(std::bind(&kafka_consumer::tick_func, this), work_thread_count);
+    if (m_options.dispatch_mode == dispatch_shared) {
+        m_work_thread_pool = new kafka_thread_pool(std::bind(&kafka_consumer::tick_func, this), work_thread_count);
+        return;
+    }
+
+    // one poll thread, the work threads get the messages from it
+    m_work_thread_pool = new kafka_thread_pool(std::bind(&kafka_consumer::dispatch_tick_func, this), 1);
+
+    for (int32_t i = 0; i < (std::max)(work_thread_count, 1); ++i) {
+        dispatch_worker* worker = new dispatch_worker((size_t)(std::max)(m_options.dispatch_queue_size, 2));
+        worker->thread_pool = new kafka_thread_pool(std::bind(&kafka_consumer::worker_tick_func, this, worker), 1);
+        m_dispatch_workers.push_back(worker);
+    }
 }
 
 kafka_consumer::~kafka_consumer() {
@@ -58,6 +220,33 @@ kafka_consumer::~kafka_consumer() {
         m_work_thread_pool = nullptr;
     }
 
+    for (auto worker : m_dispatch_workers) {
+        delete worker->thread_pool;
+
+        // the messages left in the queue must be freed before the consumer
+        dispatch_item item;
+        while (worker->queue.try_pop(&item)) {
+            delete item.message;
+        }
+
+        delete worker;
+    }
+    m_dispatch_workers.clear();
+
+    // the work threads are gone, the last handled offsets can be committed
+    final_commit();
+    close_consumer();
+
+    for (auto& iter : m_partition_offsets) {
+        delete iter.second;
+    }
+    m_partition_offsets.clear();
+
+    for (auto offsets : m_retired_partition_offsets) {
+        delete offsets;
+    }
+    m_retired_partition_offsets.clear();
+
     if (m_consumer) {
         delete m_consumer;
         m_consumer = nullptr;
@@ -72,6 +261,12 @@ kafka_consumer::~kafka_consumer() {
         delete m_default_topic_conf;
         m_default_topic_conf = nullptr;
     }
+
+    delete m_handler_table.load();
+    for (auto handler_table : m_retired_handler_tables) {
+        delete handler_table;
+    }
+    m_retired_handler_tables.clear();
 }
 
 void    kafka_consumer::set_event_handler(kafka_consumer_event_handler* handler) {
@@ -82,14 +277,10 @@ bool    kafka_consumer::subscribe(const std::string& topic_name, const consume_m
     std::vector<std::string> topic_list;
     topic_list.push_back(topic_name);
 
-    // save the topc handler first
-    {
-        std::lock_guard<std::mutex> locker(m_mtx);
-        m_consume_msg_handler_map[topic_name] = std::make_shared<consume_msg_handler>(msg_handler);
-    }
+    std::vector<consume_msg_handler> msg_handler_list;
+    msg_handler_list.push_back(msg_handler);
 
-    auto res = m_consumer->subscribe(topic_list);
-    return res == RdKafka::ERR_NO_ERROR;
+    return subscribe(topic_list, msg_handler_list);
 }
 
 bool    kafka_consumer::subscribe(const std::vector<std::string>& topic_list, const std::vector<consume_msg_handler>& msg_handler_list) {
@@ -99,49 +290,779 @@ bool    kafka_consumer::subscribe(const std::vector<std::string>& topic_list, co
     }
 
     // save the topc handler first
-    {
-        std::lock_guard<std::mutex> locker(m_mtx);
+    update_handlers(topic_list, &msg_handler_list, nullptr);
 
-        for (int32_t i = 0; i < topic_list.size(); ++i) {
-            m_consume_msg_handler_map[topic_list[i]] = std::make_shared<consume_msg_handler>(msg_handler_list[i]);
-        }
+    auto res = m_consumer->subscribe(topic_list);
+    return res == RdKafka::ERR_NO_ERROR;
+}
+
+bool    kafka_consumer::subscribe_batch(const std::string& topic_name, const consume_batch_handler& batch_handler) {
+    std::vector<std::string> topic_list;
+    topic_list.push_back(topic_name);
+
+    std::vector<consume_batch_handler> batch_handler_list;
+    batch_handler_list.push_back(batch_handler);
+
+    return subscribe_batch(topic_list, batch_handler_list);
+}
+
+bool    kafka_consumer::subscribe_batch(const std::vector<std::string>& topic_list, const std::vector<consume_batch_handler>& batch_handler_list) {
+
+    if (topic_list.size() != batch_handler_list.size()) {
+        return false;
     }
 
+    // save the topc handler first
+    update_handlers(topic_list, nullptr, &batch_handler_list);
+
     auto res = m_consumer->subscribe(topic_list);
     return res == RdKafka::ERR_NO_ERROR;
 }
 
-kafka_consumer::consume_msg_handler_ptr kafka_consumer::get_topic_handler(const std::string& topic_name) {
+void    kafka_consumer::update_handlers(const std::vector<std::string>& topic_list,
+    const std::vector<consume_msg_handler>* msg_handler_list, const std::vector<consume_batch_handler>* batch_handler_list) {
     std::lock_guard<std::mutex> locker(m_mtx);
 
-    auto iter = m_consume_msg_handler_map.find(topic_name);
-    if (iter != m_consume_msg_handler_map.end()) {
-        return iter->second;
+    // copy on write, the handlers of the topics not in topic_list are kept
+    const topic_handler_table* old_table = m_handler_table.load(std::memory_order_relaxed);
+    topic_handler_table* new_table = new topic_handler_table(*old_table);
+
+    for (size_t i = 0; i < topic_list.size(); ++i) {
+        topic_handler* handler = nullptr;
+        for (auto& existing : new_table->handlers) {
+            if (existing.topic_name == topic_list[i]) {
+                handler = &existing;
+                break;
+            }
+        }
+
+        if (!handler) {
+            new_table->handlers.push_back(topic_handler());
+            handler = &new_table->handlers.back();
+            handler->topic_name = topic_list[i];
+        }
+
+        handler->msg_handler = msg_handler_list ? (*msg_handler_list)[i] : nullptr;
+        handler->batch_handler = batch_handler_list ? (*batch_handler_list)[i] : nullptr;
     }
 
-    return consume_msg_handler_ptr();
+    new_table->build();
+    m_handler_table.store(new_table, std::memory_order_release);
+    m_retired_handler_tables.push_back(old_table);
+}
+
+const kafka_consumer::topic_handler* kafka_consumer::get_topic_handler(RdKafka::Message* message) {
+    const topic_handler_table* handler_table = m_handler_table.load(std::memory_order_acquire);
+    if (handler_table->handlers.empty() || !message->c_ptr()->rkt) {
+        return nullptr;
+    }
+
+    // the name is owned by the librdkafka topic handle, nothing is copied
+    return handler_table->find(rd_kafka_topic_name(message->c_ptr()->rkt));
 }
 
 void    kafka_consumer::start() {
     m_work_thread_pool->start();
+
+    for (auto worker : m_dispatch_workers) {
+        worker->thread_pool->start();
+    }
 }
 
 void    kafka_consumer::stop() {
+    // the waits of the poll thread and of the rebalance give up at once
+    m_stop_deadline_ms = 0;
+    m_stopping = true;
     m_work_thread_pool->stop();
+
+    for (auto worker : m_dispatch_workers) {
+        worker->stopping = true;
+        worker->thread_pool->stop();
+
+        std::lock_guard<std::mutex> locker(worker->mtx);
+        worker->cv.notify_one();
+    }
 }
 
 void    kafka_consumer::wait_for_stop() {
     m_work_thread_pool->join_all();
+
+    for (auto worker : m_dispatch_workers) {
+        worker->thread_pool->join_all();
+    }
+
+    final_commit();
+    close_consumer();
+}
+
+bool    kafka_consumer::shutdown(int32_t timeout_ms, kafka_shutdown_report* report) {
+    int64_t start_ms = steady_now_ms();
+    int64_t deadline_ms = start_ms + (std::max)(timeout_ms, 0);
+    kafka_shutdown_report result;
+
+    // no more consume, the poll threads finish the message in hand first, their waits give up at the deadline
+    m_stop_deadline_ms = deadline_ms;
+    m_stopping = true;
+    m_work_thread_pool->stop();
+    m_work_thread_pool->join_all();
+
+    // the work threads go on with their queues until the deadline
+    for (auto worker : m_dispatch_workers) {
+        while (worker->done_count.load() != worker->pushed_count.load() && steady_now_ms() < deadline_ms) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    stop();
+    for (auto worker : m_dispatch_workers) {
+        worker->thread_pool->join_all();
+
+        // their offsets stay pending, the commit stops before them
+        dispatch_item item;
+        while (worker->queue.try_pop(&item)) {
+            ++result.unhandled_count;
+            delete item.message;
+        }
+    }
+
+    result.unhandled_count += (int32_t)m_dropped_count.load();
+
+    RdKafka::ErrorCode err = final_commit();
+    RdKafka::ErrorCode close_err = close_consumer();
+    result.commit_error = err != RdKafka::ERR_NO_ERROR ? err : close_err;
+
+    result.completed = result.unhandled_count == 0 && result.commit_error == RdKafka::ERR_NO_ERROR;
+    result.elapsed_ms = steady_now_ms() - start_ms;
+
+    if (report) {
+        *report = result;
+    }
+
+    return result.completed;
+}
+
+bool    kafka_consumer::seek(const std::string& topic_name, int32_t partition, int64_t offset, int32_t timeout_ms, std::string* err_string) {
+    std::vector<RdKafka::TopicPartition*> assignment;
+    m_consumer->assignment(assignment);
+
+    bool assigned = false;
+    for (auto part : assignment) {
+        if (part->partition() == partition && part->topic() == topic_name) {
+            assigned = true;
+            break;
+        }
+    }
+    RdKafka::TopicPartition::destroy(assignment);
+
+    if (!assigned) {
+        if (err_string) {
+            *err_string = "partition is not assigned to this consumer";
+        }
+        return false;
+    }
+
+    RdKafka::TopicPartition* part = RdKafka::TopicPartition::create(topic_name, partition, offset);
+    RdKafka::ErrorCode err = m_consumer->seek(*part, timeout_ms);
+    delete part;
+
+    if (err != RdKafka::ERR_NO_ERROR) {
+        if (err_string) {
+            *err_string = RdKafka::err2str(err);
+        }
+        return false;
+    }
+
+    log_msg(RdKafka::Event::EVENT_SEVERITY_INFO, "seek topic[%s] partition[%d] to offset[%lld]",
+        topic_name.c_str(), partition, offset);
+    return true;
+}
+
+bool    kafka_consumer::seek_to_time(const std::string& topic_name, int64_t timestamp_ms, int32_t timeout_ms, std::string* err_string) {
+    std::vector<RdKafka::TopicPartition*> assignment;
+    m_consumer->assignment(assignment);
+
+    // offsetsForTimes takes the timestamps in the offset field
+    std::vector<RdKafka::TopicPartition*> offsets;
+    for (auto part : assignment) {
+        if (part->topic() == topic_name) {
+            offsets.push_back(RdKafka::TopicPartition::create(topic_name, part->partition(), timestamp_ms));
+        }
+    }
+    RdKafka::TopicPartition::destroy(assignment);
+
+    if (offsets.empty()) {
+        if (err_string) {
+            *err_string = "no partition of topic " + topic_name + " is assigned to this consumer";
+        }
+        return false;
+    }
+
+    RdKafka::ErrorCode err = m_consumer->offsetsForTimes(offsets, timeout_ms);
+    if (err != RdKafka::ERR_NO_ERROR) {
+        if (err_string) {
+            *err_string = RdKafka::err2str(err);
+        }
+
+        RdKafka::TopicPartition::destroy(offsets);
+        return false;
+    }
+
+    bool ret = true;
+    for (auto part : offsets) {
+        err = part->err();
+        if (err == RdKafka::ERR_NO_ERROR) {
+            // no message at or after the timestamp
+            if (part->offset() < 0) {
+                part->set_offset(RdKafka::Topic::OFFSET_END);
+            }
+
+            err = m_consumer->seek(*part, timeout_ms);
+        }
+
+        if (err != RdKafka::ERR_NO_ERROR) {
+            if (err_string) {
+                char buffer[32];
+                snprintf(buffer, sizeof(buffer), "partition[%d]: ", part->partition());
+                *err_string = buffer + RdKafka::err2str(err);
+            }
+            ret = false;
+            continue;
+        }
+
+        log_msg(RdKafka::Event::EVENT_SEVERITY_INFO, "seek topic[%s] partition[%d] to offset[%lld] of time[%lld]",
+            topic_name.c_str(), part->partition(), part->offset(), timestamp_ms);
+    }
+
+    RdKafka::TopicPartition::destroy(offsets);
+    return ret;
+}
+
+bool    kafka_consumer::ack(const std::string& topic_name, int32_t partition, int64_t offset) {
+    std::lock_guard<std::mutex> locker(m_offsets_mtx);
+
+    auto iter = m_partition_offsets.find(partition_key(topic_name.c_str(), partition));
+    if (iter == m_partition_offsets.end()) {
+        return false;
+    }
+
+    if (!iter->second->tracker.complete(offset)) {
+        return false;
+    }
+
+    ++m_uncommitted_acks;
+    return true;
 }
 
 bool    kafka_consumer::tick_func() {
-    RdKafka::Message *msg = m_consumer->consume(1000);
+    if (m_options.batch_size > 0) {
+        return batch_tick_func();
+    }
+
+    RdKafka::Message* msg = nullptr;
+    kafka_offset_tracker* tracker = nullptr;
+
+    if (m_options.manual_commit) {
+        std::lock_guard<std::mutex> locker(m_consume_mtx);
+        flush_offsets(false);
+
+        msg = m_consumer->consume(consume_timeout_ms());
+        if (msg->err() == RdKafka::ERR_NO_ERROR && msg->c_ptr()->rkt) {
+            tracker = track_offset(msg);
+        }
+    }
+    else {
+        msg = m_consumer->consume(consume_timeout_ms());
+    }
+
     bool ret = msg_consume(msg, NULL);
+    complete_offset(tracker, msg->offset());
     delete msg;
 
     return ret;
 }
 
+bool    kafka_consumer::dispatch_tick_func() {
+    RdKafka::Message* msg = m_consumer->consume(consume_timeout_ms());
+
+    if (offsets_tracked()) {
+        flush_offsets(false);
+    }
+
+    if (msg->err() != RdKafka::ERR_NO_ERROR || !msg->c_ptr()->rkt) {
+        bool ret = msg_consume(msg, NULL);
+        delete msg;
+        return ret;
+    }
+
+    if (m_options.dispatch_mode == dispatch_by_key) {
+        return dispatch_by_key_msg(msg);
+    }
+
+    uint64_t key = partition_key(rd_kafka_topic_name(msg->c_ptr()->rkt), msg->partition());
+
+    auto iter = m_partition_pins.find(key);
+    int32_t worker_index = iter != m_partition_pins.end() ? iter->second : pin_partition(key);
+
+    kafka_offset_tracker* tracker = track_offset(msg);
+    if (!tracker) {
+        delete msg;
+        ++m_dropped_count;
+        return false;
+    }
+
+    push_to_worker(m_dispatch_workers[worker_index], msg, tracker);
+    return true;
+}
+
+bool    kafka_consumer::worker_tick_func(dispatch_worker* worker) {
+    static thread_local std::vector<RdKafka::Message*> messages;
+    static thread_local std::vector<dispatch_item> items;
+    size_t max_count = m_options.batch_size > 0 ? (size_t)m_options.batch_size : 64;
+
+    dispatch_item item;
+    while (items.size() < max_count && worker->queue.try_pop(&item)) {
+        items.push_back(item);
+        messages.push_back(item.message);
+    }
+
+    if (messages.empty()) {
+        // announce the sleep before the last look at the queue, see push_to_worker
+        worker->sleeping = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        {
+            std::unique_lock<std::mutex> locker(worker->mtx);
+            worker->cv.wait_for(locker, std::chrono::milliseconds(100), [&] {
+                return !worker->queue.empty() || worker->stopping.load();
+            });
+        }
+
+        worker->sleeping = false;
+        return true;
+    }
+
+    if (m_options.batch_size > 0) {
+        dispatch_batch(messages);
+    }
+    else {
+        for (auto message : messages) {
+            msg_consume(message, NULL);
+        }
+    }
+
+    for (auto& done_item : items) {
+        complete_offset(done_item.tracker, done_item.message->offset());
+        delete done_item.message;
+    }
+
+    worker->done_count += items.size();
+    items.clear();
+    messages.clear();
+    return true;
+}
+
+void    kafka_consumer::push_to_worker(dispatch_worker* worker, RdKafka::Message* message, kafka_offset_tracker* tracker) {
+    ++worker->pushed_count;
+
+    dispatch_item item;
+    item.message = message;
+    item.tracker = tracker;
+
+    while (!worker->queue.try_push(item)) {
+        if (wait_expired()) {
+            delete message;
+            ++worker->done_count;
+            ++m_dropped_count;
+            return;
+        }
+
+        // the worker is behind, hold the poll thread back
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (worker->sleeping.load()) {
+        std::lock_guard<std::mutex> locker(worker->mtx);
+        worker->cv.notify_one();
+    }
+}
+
+int32_t kafka_consumer::pin_partition(uint64_t partition_key) {
+    int32_t worker_index = 0;
+    for (int32_t i = 1; i < (int32_t)m_dispatch_workers.size(); ++i) {
+        if (m_dispatch_workers[i]->pinned_count < m_dispatch_workers[worker_index]->pinned_count) {
+            worker_index = i;
+        }
+    }
+
+    ++m_dispatch_workers[worker_index]->pinned_count;
+    m_partition_pins[partition_key] = worker_index;
+    return worker_index;
+}
+
+bool    kafka_consumer::drain_workers(const std::vector<RdKafka::TopicPartition*>& partitions) {
+    // dispatch_by_partition waits for the workers of the revoked partitions only, the others go on
+    std::vector<dispatch_worker*> workers;
+    if (m_options.dispatch_mode == dispatch_by_partition) {
+        for (auto part : partitions) {
+            auto iter = m_partition_pins.find(partition_key(part->topic().c_str(), part->partition()));
+            if (iter != m_partition_pins.end()) {
+                workers.push_back(m_dispatch_workers[iter->second]);
+            }
+        }
+    }
+    else if (!m_options.manual_ack) {
+        // dispatch_by_key spreads a partition over all the workers, its tracker tells when they are done with it
+        for (auto part : partitions) {
+            auto iter = m_partition_offsets.find(partition_key(part->topic().c_str(), part->partition()));
+            if (iter == m_partition_offsets.end()) {
+                continue;
+            }
+
+            while (!iter->second->tracker.idle()) {
+                if (wait_expired()) {
+                    return false;
+                }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        return true;
+    }
+    else {
+        workers = m_dispatch_workers;
+    }
+
+    for (auto worker : workers) {
+        while (worker->done_count.load() != worker->pushed_count.load()) {
+            if (wait_expired()) {
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    return true;
+}
+
+bool    kafka_consumer::dispatch_by_key_msg(RdKafka::Message* message) {
+    kafka_offset_tracker* tracker = track_offset(message);
+    if (!tracker) {
+        delete message;
+        ++m_dropped_count;
+        return false;
+    }
+
+    // not the murmur2 of the default partitioner, the keys of one partition would only reach some of the workers
+    uint32_t worker_index = 0;
+    if (message->key_pointer()) {
+        worker_index = xxhash32_hash()(static_cast<const char*>(message->key_pointer()), message->key_len());
+    }
+    else {
+        // no key, no order to keep
+        worker_index = m_next_worker++;
+    }
+
+    push_to_worker(m_dispatch_workers[worker_index % m_dispatch_workers.size()], message, tracker);
+    return true;
+}
+
+bool    kafka_consumer::offsets_tracked() const {
+    // the auto store would store the offsets of the messages still queued to the work threads
+    return m_options.manual_commit || m_options.dispatch_mode != dispatch_shared;
+}
+
+int32_t kafka_consumer::consume_timeout_ms() const {
+    // the consume must come back in time for the interval commit, and for stop and shutdown
+    if (m_options.manual_commit && m_options.commit_interval_ms < 100) {
+        return (std::max)(m_options.commit_interval_ms, 1);
+    }
+
+    return 100;
+}
+
+bool    kafka_consumer::wait_expired() const {
+    return m_stopping.load() && steady_now_ms() >= m_stop_deadline_ms.load();
+}
+
+kafka_offset_tracker* kafka_consumer::track_offset(RdKafka::Message* message) {
+    const char* topic_name = rd_kafka_topic_name(message->c_ptr()->rkt);
+    uint64_t key = partition_key(topic_name, message->partition());
+
+    // only the consuming thread changes the map, it can look it up without the lock
+    partition_offsets* offsets = nullptr;
+    auto iter = m_partition_offsets.find(key);
+    if (iter != m_partition_offsets.end()) {
+        offsets = iter->second;
+    }
+    else {
+        offsets = new partition_offsets(topic_name, message->partition(), m_options.dispatch_max_pending);
+
+        std::lock_guard<std::mutex> locker(m_offsets_mtx);
+        m_partition_offsets[key] = offsets;
+    }
+
+    while (!offsets->tracker.track(message->offset())) {
+        if (wait_expired()) {
+            return nullptr;
+        }
+
+        // too many offsets in flight behind a slow one, hold the consume back
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        flush_offsets(false);
+    }
+
+    return &offsets->tracker;
+}
+
+void    kafka_consumer::complete_offset(kafka_offset_tracker* tracker, int64_t offset) {
+    // with manual_ack the handler acks by itself
+    if (!tracker || m_options.manual_ack) {
+        return;
+    }
+
+    tracker->complete(offset);
+    ++m_uncommitted_acks;
+}
+
+RdKafka::ErrorCode kafka_consumer::flush_offsets(bool sync) {
+    int64_t now_ms = steady_now_ms();
+    if (!sync && now_ms < m_next_flush_ms &&
+        (!m_options.manual_commit || m_uncommitted_acks.load() < m_options.commit_interval_msgs)) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+    m_next_flush_ms = now_ms + (m_options.manual_commit ? m_options.commit_interval_ms : (int32_t)offset_store_interval_ms);
+
+    for (size_t i = 0; i < m_retired_partition_offsets.size();) {
+        if (m_retired_partition_offsets[i]->tracker.idle()) {
+            delete m_retired_partition_offsets[i];
+            m_retired_partition_offsets[i] = m_retired_partition_offsets.back();
+            m_retired_partition_offsets.pop_back();
+            continue;
+        }
+        ++i;
+    }
+
+    std::vector<RdKafka::TopicPartition*> offsets;
+    for (auto& iter : m_partition_offsets) {
+        partition_offsets* part = iter.second;
+
+        int64_t offset = part->tracker.committed_offset();
+        if (offset >= 0 && offset != part->stored_offset) {
+            offsets.push_back(RdKafka::TopicPartition::create(part->topic_name, part->partition, offset));
+            part->stored_offset = offset;
+        }
+    }
+
+    if (offsets.empty()) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    RdKafka::ErrorCode err = RdKafka::ERR_NO_ERROR;
+    if (m_options.manual_commit) {
+        m_uncommitted_acks = 0;
+        err = sync ? m_consumer->commitSync(offsets) : m_consumer->commitAsync(offsets);
+    }
+    else {
+        err = m_consumer->offsets_store(offsets);
+    }
+
+    if (err != RdKafka::ERR_NO_ERROR) {
+        log_msg(RdKafka::Event::EVENT_SEVERITY_WARNING, "%s failed: %s", 
+            m_options.manual_commit ? "commit" : "offsets_store", RdKafka::err2str(err).c_str());
+    }
+
+    RdKafka::TopicPartition::destroy(offsets);
+    return err;
+}
+
+void    kafka_consumer::retire_offsets(const std::vector<RdKafka::TopicPartition*>& partitions) {
+    for (auto part : partitions) {
+        auto iter = m_partition_offsets.find(partition_key(part->topic().c_str(), part->partition()));
+        if (iter == m_partition_offsets.end()) {
+            continue;
+        }
+
+        partition_offsets* offsets = iter->second;
+        {
+            std::lock_guard<std::mutex> locker(m_offsets_mtx);
+            m_partition_offsets.erase(iter);
+
+            // nothing but ack() reaches the tracker with manual_ack
+            if (m_options.manual_ack) {
+                delete offsets;
+                continue;
+            }
+        }
+
+        // handlers still running complete on it, freed by flush_offsets once idle
+        m_retired_partition_offsets.push_back(offsets);
+    }
+}
+
+RdKafka::ErrorCode kafka_consumer::close_consumer() {
+    if (m_closed.exchange(true)) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    if (m_options.group_instance_id.empty()) {
+        log_msg(RdKafka::Event::EVENT_SEVERITY_INFO, "close: leaving the group");
+    }
+    else {
+        log_msg(RdKafka::Event::EVENT_SEVERITY_INFO, "close: static member[%s], the assignment is kept for the session timeout",
+            m_options.group_instance_id.c_str());
+    }
+
+    // the revoke of the close runs rebalance_cb on this thread, the work threads are joined already
+    RdKafka::ErrorCode err = m_consumer->close();
+    if (err != RdKafka::ERR_NO_ERROR) {
+        log_msg(RdKafka::Event::EVENT_SEVERITY_WARNING, "close failed: %s", RdKafka::err2str(err).c_str());
+    }
+
+    return err;
+}
+
+RdKafka::ErrorCode kafka_consumer::final_commit() {
+    if (!offsets_tracked() || m_final_committed.exchange(true)) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    return flush_offsets(true);
+}
+
+bool    kafka_consumer::batch_tick_func() {
+    std::vector<RdKafka::Message*> messages;
+    messages.reserve(m_options.batch_size);
+
+    std::vector<kafka_offset_tracker*> trackers;
+    std::unique_lock<std::mutex> locker(m_consume_mtx, std::defer_lock);
+    if (m_options.manual_commit) {
+        locker.lock();
+        flush_offsets(false);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_options.batch_timeout_ms);
+    int32_t timeout_ms = m_options.batch_timeout_ms;
+
+    while ((int32_t)messages.size() < m_options.batch_size) {
+        // in slices, so that stop does not wait for a long batch_timeout_ms
+        RdKafka::Message* msg = m_consumer->consume((std::min)(timeout_ms, consume_timeout_ms()));
+        if (msg->err() == RdKafka::ERR__TIMED_OUT) {
+            delete msg;
+
+            timeout_ms = (int32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+            if (timeout_ms <= 0 || m_stopping.load()) {
+                break;
+            }
+            continue;
+        }
+
+        messages.push_back(msg);
+        if (m_options.manual_commit) {
+            bool trackable = msg->err() == RdKafka::ERR_NO_ERROR && msg->c_ptr()->rkt;
+            trackers.push_back(trackable ? track_offset(msg) : nullptr);
+        }
+
+        // the rest of the batch takes what is already queued, up to the deadline
+        timeout_ms = (int32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (timeout_ms < 0) {
+            timeout_ms = 0;
+        }
+    }
+
+    if (locker.owns_lock()) {
+        locker.unlock();
+    }
+
+    bool ret = !messages.empty();
+    dispatch_batch(messages);
+
+    for (size_t i = 0; i < messages.size(); ++i) {
+        if (i < trackers.size()) {
+            complete_offset(trackers[i], messages[i]->offset());
+        }
+
+        delete messages[i];
+    }
+
+    return ret;
+}
+
+void    kafka_consumer::dispatch_batch(std::vector<RdKafka::Message*>& messages) {
+    struct topic_batch {
+        const topic_handler*        handler;
+        std::vector<kafka_msg_view> views;
+    };
+
+    // kept per thread, so the views do not allocate once warmed up
+    static thread_local std::vector<topic_batch> batches;
+    size_t batch_count = 0;
+
+    for (auto msg : messages) {
+        if (msg->err() != RdKafka::ERR_NO_ERROR) {
+            msg_consume(msg, NULL);
+            continue;
+        }
+
+        const topic_handler* handler = get_topic_handler(msg);
+        if (!handler || !handler->batch_handler) {
+            msg_consume(msg, NULL);
+            continue;
+        }
+
+        topic_batch* batch = nullptr;
+        for (size_t i = 0; i < batch_count; ++i) {
+            if (batches[i].handler == handler) {
+                batch = &batches[i];
+                break;
+            }
+        }
+
+        if (!batch) {
+            if (batch_count == batches.size()) {
+                batches.push_back(topic_batch());
+            }
+
+            batch = &batches[batch_count++];
+            batch->handler = handler;
+        }
+
+        kafka_msg_view view;
+        view.partition = msg->partition();
+        view.offset = msg->offset();
+        view.timestamp = msg->timestamp().timestamp;
+        view.key = static_cast<const char *>(msg->key_pointer());
+        view.key_len = static_cast<int32_t>(msg->key_len());
+        view.payload = static_cast<const char *>(msg->payload());
+        view.len = static_cast<int32_t>(msg->len());
+
+        if (m_options.unpack_envelopes && kafka_envelope::marked(msg->c_ptr()) &&
+            kafka_envelope::unpack(view.payload, msg->len(), [&](const char* record, int32_t record_len) {
+                view.payload = record;
+                view.len = record_len;
+                batch->views.push_back(view);
+            })) {
+            continue;
+        }
+
+        batch->views.push_back(view);
+    }
+
+    for (size_t i = 0; i < batch_count; ++i) {
+        auto& batch = batches[i];
+        if (!batch.views.empty()) {
+            batch.handler->batch_handler(batch.handler->topic_name, &batch.views[0], (int32_t)batch.views.size());
+        }
+
+        batch.views.clear();
+        batch.handler = nullptr;
+    }
+}
+
 bool    kafka_consumer::msg_consume(RdKafka::Message* message, void* opaque) {
     bool ret = false;
     switch (message->err())
@@ -159,13 +1080,20 @@ bool    kafka_consumer::msg_consume(RdKafka::Message* message, void* opaque) {
     {
         ret = true;
 
-        std::string topic_name(std::move(message->topic_name()));
+        const topic_handler* handler = get_topic_handler(message);
+        if (handler && handler->msg_handler) {
+            const consume_msg_handler& msg_handler = handler->msg_handler;
+            const char* payload = static_cast<const char *>(message->payload());
+            if (m_options.unpack_envelopes && kafka_envelope::marked(message->c_ptr()) &&
+                kafka_envelope::unpack(payload, message->len(), [&](const char* record, int32_t record_len) {
+                    msg_handler(handler->topic_name, message->partition(), message->offset(), message->key(), record, record_len);
+                })) {
+                break;
+            }
 
-        auto msg_handler = get_topic_handler(topic_name);
-        if (msg_handler) {
-            (*msg_handler)(topic_name, message->partition(), message->offset(), 
+            msg_handler(handler->topic_name, message->partition(), message->offset(), 
                 message->key(),
-                static_cast<const char *>(message->payload()), static_cast<int32_t>(message->len()));
+                payload, static_cast<int32_t>(message->len()));
             break;
         }
 
@@ -295,6 +1223,47 @@ void    kafka_consumer::rebalance_cb(RdKafka::KafkaConsumer *consumer,
 
     int64_t default_start_offset = RdKafka::Topic::OFFSET_STORED;
 
+    if (!m_dispatch_workers.empty()) {
+        // called on the poll thread, no message is pushed meanwhile
+        if (err == RdKafka::ERR__ASSIGN_PARTITIONS) {
+            // dispatch_by_key spreads every partition over all the workers, nothing to pin
+            for (auto part : partitions) {
+                if (m_options.dispatch_mode != dispatch_by_partition) {
+                    break;
+                }
+
+                uint64_t key = partition_key(part->topic().c_str(), part->partition());
+                if (m_partition_pins.find(key) == m_partition_pins.end()) {
+                    pin_partition(key);
+                }
+            }
+        }
+        else {
+            // the revoked partitions are finished before they are handed to another consumer
+            drain_workers(partitions);
+
+            for (auto part : partitions) {
+                auto iter = m_partition_pins.find(partition_key(part->topic().c_str(), part->partition()));
+                if (iter != m_partition_pins.end()) {
+                    --m_dispatch_workers[iter->second]->pinned_count;
+                    m_partition_pins.erase(iter);
+                }
+            }
+        }
+    }
+
+    if (err != RdKafka::ERR__ASSIGN_PARTITIONS && offsets_tracked()) {
+        // the handled offsets go with the revoke, committed sync with manual_commit;
+        // a lost assignment is owned by another member already, its commit would fail
+        if (!consumer->assignment_lost()) {
+            flush_offsets(true);
+        }
+        retire_offsets(partitions);
+    }
+
+    // cooperative-sticky: the lists are the increments, the partitions not in them stay assigned
+    bool incremental = consumer->rebalance_protocol() == "COOPERATIVE";
+
     if (err == RdKafka::ERR__ASSIGN_PARTITIONS) {
         for (unsigned int i = 0; i < partitions.size(); i++) {
             auto& tpp = partitions[i];
@@ -304,9 +1273,29 @@ void    kafka_consumer::rebalance_cb(RdKafka::KafkaConsumer *consumer,
                 tpp->topic().c_str(), tpp->partition(), tpp->offset());
         }
 
-        consumer->assign(partitions);
+        if (incremental) {
+            RdKafka::Error* error = consumer->incremental_assign(partitions);
+            if (error) {
+                log_msg(RdKafka::Event::EVENT_SEVERITY_ERROR, "incremental_assign failed: %s", error->str().c_str());
+                delete error;
+            }
+
+            m_total_partition_count += (int32_t)partitions.size();
+        }
+        else {
+            consumer->assign(partitions);
+
+            m_total_partition_count = (int32_t)partitions.size();
+        }
+    }
+    else if (incremental) {
+        RdKafka::Error* error = consumer->incremental_unassign(partitions);
+        if (error) {
+            log_msg(RdKafka::Event::EVENT_SEVERITY_ERROR, "incremental_unassign failed: %s", error->str().c_str());
+            delete error;
+        }
 
-        m_total_partition_count = (int32_t)partitions.size();
+        m_total_partition_count -= (std::min)((int32_t)partitions.size(), m_total_partition_count);
     }
     else {
         consumer->unassign();
@@ -17,6 +17,7 @@
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <atomic>
 #include <unordered_map>
 #include <rdkafkacpp.h>
 
@@ -24,6 +25,15 @@ namespace utility {
 
 class kafka_consumer_event_handler;
 class kafka_thread_pool;
+class kafka_offset_tracker;
+
+/** how the consumed messages are spread over the work threads */
+enum kafka_dispatch_mode {
+    dispatch_shared,            /** every work thread consumes and handles, no ordering between the threads */
+    dispatch_by_partition,      /** one poll thread feeds the work threads, each partition is pinned to one of them */
+    dispatch_by_key,            /** one poll thread feeds the work threads by the hash of the message key, ordered per key only */
+};
+
 struct kafka_consumer_options
 {
     std::string broker_list;
@@ -32,11 +42,84 @@ struct kafka_consumer_options
     std::string sasl_password;
     std::string group_id;
     std::string debug;
+    /** 
+     * partition.assignment.strategy, empty for the librdkafka default; with "cooperative-sticky" a rebalance
+     * only revokes the partitions that move, the others keep being consumed and keep their work thread
+     */
+    std::string assignment_strategy;
+    /** 
+     * group.instance.id, makes the consumer a static member: it does not leave the group when closed,
+     * a restart with the same id within session_timeout_ms gets its old assignment back without a rebalance
+     */
+    std::string group_instance_id;
+    /** session.timeout.ms, heartbeat.interval.ms and max.poll.interval.ms, 0 for the librdkafka defaults */
+    int32_t     session_timeout_ms;
+    int32_t     heartbeat_interval_ms;
+    int32_t     max_poll_interval_ms;
+    /** 
+     * split the envelopes of kafka_msg_packer, the consume_msg_handler is called once per record
+     * with the offset of the envelope; on_consume_msg still gets the envelope as it is.
+     * only the messages with the kafka_envelope header are split, the others are handled as they are
+     */
+    bool        unpack_envelopes;
+    /** 
+     * batch mode if batch_size > 0: each work thread consumes up to batch_size messages or waits up to batch_timeout_ms,
+     * then calls the consume_batch_handler of each topic once with its messages, in order per partition
+     */
+    int32_t     batch_size;
+    int32_t     batch_timeout_ms;
+    /** 
+     * with dispatch_by_partition the messages of a partition are handled in order by one work thread, 
+     * the pins are rebuilt in rebalance_cb, after the work threads finished the revoked partitions
+     */
+    kafka_dispatch_mode dispatch_mode;
+    /** capacity of the queue of each work thread, the poll thread waits when it is full */
+    int32_t     dispatch_queue_size;
+    /** 
+     * the queued dispatch modes store the offset of the first message not yet handled for the auto commit,
+     * dispatch_by_key completes it out of order; the poll thread waits when a partition has this many offsets in flight
+     */
+    int32_t     dispatch_max_pending;
+    /** 
+     * manual_commit turns the auto commit off: a message is acked when its handler returns, or by ack() with manual_ack;
+     * the acked offsets are coalesced per partition and committed async every commit_interval_msgs acks or commit_interval_ms,
+     * sync on revoke and on stop; the commit stops at the first offset not acked yet, at-least-once
+     */
+    bool        manual_commit;
+    bool        manual_ack;
+    int32_t     commit_interval_msgs;
+    int32_t     commit_interval_ms;
 
-    kafka_consumer_options() : use_sasl(false) {
+    kafka_consumer_options() 
+        : use_sasl(false)
+        , session_timeout_ms(0)
+        , heartbeat_interval_ms(0)
+        , max_poll_interval_ms(0)
+        , unpack_envelopes(false)
+        , batch_size(0)
+        , batch_timeout_ms(100)
+        , dispatch_mode(dispatch_shared)
+        , dispatch_queue_size(1024)
+        , dispatch_max_pending(65536)
+        , manual_commit(false)
+        , manual_ack(false)
+        , commit_interval_msgs(1000)
+        , commit_interval_ms(1000){
     }
 };
 
+/** a consumed message in batch mode, it points into the librdkafka message, valid only during the handler call */
+struct kafka_msg_view
+{
+    int32_t     partition;
+    int64_t     offset;
+    int64_t     timestamp;
+    const char* key;            /** nullptr if the message has no key */
+    int32_t     key_len;
+    const char* payload;
+    int32_t     len;
+};
+
 class kafka_consumer :
     public RdKafka::EventCb,
     public RdKafka::RebalanceCb
@@ -44,15 +127,34 @@ class kafka_consumer :
 public:
     typedef std::function<void(const std::string& topic_name, int32_t partition, int64_t offset, const std::string* key, const char* msg, int32_t msg_len)> consume_msg_handler;
     typedef std::shared_ptr<consume_msg_handler> consume_msg_handler_ptr;
+    typedef std::function<void(const std::string& topic_name, const kafka_msg_view* msgs, int32_t msg_count)> consume_batch_handler;
 
 protected:
     enum {
         max_log_len = 1023,
+        offset_store_interval_ms = 100,
     };
 
 protected:
-    /* <topic_name, msg_handler > */
-    typedef std::unordered_map<std::string, consume_msg_handler_ptr> consume_msg_handler_map_type;
+    /** the handlers of one topic */
+    struct topic_handler {
+        std::string             topic_name;
+        uint64_t                name_hash;
+        consume_msg_handler     msg_handler;
+        consume_batch_handler   batch_handler;
+    };
+
+    /** 
+     * immutable snapshot of the topic handlers, replaced as a whole by subscribe;
+     * open addressing by the hash of the topic name, so the dispatch neither locks nor allocates
+     */
+    struct topic_handler_table {
+        std::vector<topic_handler>  handlers;
+        std::vector<int32_t>        slots;      /** index into handlers, -1 for empty, size is a power of two */
+
+        const topic_handler*    find(const char* topic_name) const;
+        void    build();
+    };
 
     kafka_thread_pool*              m_work_thread_pool;
     kafka_consumer_event_handler*   m_event_handler;
@@ -61,8 +163,39 @@ protected:
     RdKafka::Conf*                  m_default_topic_conf;
     RdKafka::KafkaConsumer*         m_consumer;
     int32_t                         m_total_partition_count;
+    /** a work thread of the dispatch modes, fed by the poll thread */
+    struct dispatch_worker;
+    /** the completed offsets of a partition with dispatch_by_key */
+    struct partition_offsets;
+
+    /** serializes the subscribes */
     std::mutex                      m_mtx;
-    consume_msg_handler_map_type    m_consume_msg_handler_map;
+    std::atomic<const topic_handler_table*> m_handler_table;
+    /** replaced tables, work threads may still be reading them, freed with the consumer */
+    std::vector<const topic_handler_table*> m_retired_handler_tables;
+    std::vector<dispatch_worker*>   m_dispatch_workers;
+    /** <topic partition key, worker index>, used by the poll thread only */
+    std::unordered_map<uint64_t, int32_t>   m_partition_pins;
+    /** 
+     * <topic partition key, offsets>, changed by the thread that consumes (the poll thread, or the one holding m_consume_mtx),
+     * under m_offsets_mtx as ack() reads it from any thread
+     */
+    std::unordered_map<uint64_t, partition_offsets*>    m_partition_offsets;
+    /** revoked partitions, freed once their handlers returned */
+    std::vector<partition_offsets*> m_retired_partition_offsets;
+    std::mutex                      m_offsets_mtx;
+    /** the work threads of dispatch_shared take turns on consume with manual_commit, so the offsets are tracked in order */
+    std::mutex                      m_consume_mtx;
+    std::atomic<int32_t>            m_uncommitted_acks;
+    std::atomic<bool>               m_final_committed;
+    std::atomic<bool>               m_closed;
+    int64_t                         m_next_flush_ms;
+    uint32_t                        m_next_worker;
+    std::atomic<bool>               m_stopping;
+    /** the poll thread's waits for the offset window and the worker queues give up at it once stopping, see wait_expired */
+    std::atomic<int64_t>            m_stop_deadline_ms;
+    /** consumed messages the poll thread dropped because of the stop, before they reached a handler */
+    std::atomic<int64_t>            m_dropped_count;
 
 public:
     kafka_consumer(const kafka_consumer_options& options, int32_t work_thread_count = 1);
@@ -72,10 +205,47 @@ public:
     void    set_event_handler(kafka_consumer_event_handler* handler);
     bool    subscribe(const std::string& topic_name, const consume_msg_handler& msg_handler);
     bool    subscribe(const std::vector<std::string>& topic_list,  const std::vector<consume_msg_handler>& msg_handler_list);
+
+    /** subscribe with batch handlers, they are called only if batch_size > 0 */
+    bool    subscribe_batch(const std::string& topic_name, const consume_batch_handler& batch_handler);
+    bool    subscribe_batch(const std::vector<std::string>& topic_list, const std::vector<consume_batch_handler>& batch_handler_list);
     void    start();
     void    stop();
+
+    /** 
+     * joins the work threads, commits the handled offsets and closes the consumer:
+     * a dynamic member leaves the group, a static member (group_instance_id) keeps its assignment until the session times out
+     */
     void    wait_for_stop();
 
+    /** 
+     * stops the consume, lets the work threads handle what they have queued for up to timeout_ms,
+     * drops the rest, then commits and closes as wait_for_stop does; true if nothing was dropped and the commit and close succeeded.
+     * the poll thread's waits for a full offset window or worker queue also end at the deadline, so a handler that stopped acking
+     * does not hold it up; the consume polls in slices of up to 100ms
+     */
+    bool    shutdown(int32_t timeout_ms, kafka_shutdown_report* report = nullptr);
+
+    /** 
+     * moves the consume position of an assigned partition while consuming, RdKafka::Topic::OFFSET_BEGINNING/OFFSET_END work too;
+     * the messages already given to the work threads are still handled, the tracked offsets follow the rewind once they are
+     */
+    bool    seek(const std::string& topic_name, int32_t partition, int64_t offset, int32_t timeout_ms, std::string* err_string);
+
+    /** 
+     * seeks every assigned partition of the topic to its first message at or after timestamp_ms (ms since epoch),
+     * the partitions without such a message go to the end; the offsets are looked up with one offsetsForTimes,
+     * librdkafka sends the requests to the leaders in parallel
+     */
+    bool    seek_to_time(const std::string& topic_name, int64_t timestamp_ms, int32_t timeout_ms, std::string* err_string);
+
+    /** 
+     * with manual_ack, marks a message handled; the offset must be one given to the handler of that partition.
+     * the records of an envelope share its offset, ack after the last one; false if the partition is not assigned
+     * or the offset is not pending: acked twice, out of the tracked window or delivered before a seek
+     */
+    bool    ack(const std::string& topic_name, int32_t partition, int64_t offset);
+
 protected:
     /** implement the interface from EventCb */
     void    event_cb(RdKafka::Event &event) override;
@@ -87,8 +257,27 @@ protected:
 
 protected:
     bool    msg_consume(RdKafka::Message* message, void* opaque);
-    consume_msg_handler_ptr get_topic_handler(const std::string& topic_name);
+    const topic_handler*    get_topic_handler(RdKafka::Message* message);
+    void    update_handlers(const std::vector<std::string>& topic_list, 
+        const std::vector<consume_msg_handler>* msg_handler_list, const std::vector<consume_batch_handler>* batch_handler_list);
+    void    dispatch_batch(std::vector<RdKafka::Message*>& messages);
     bool    tick_func();
+    bool    batch_tick_func();
+    bool    dispatch_tick_func();
+    bool    worker_tick_func(dispatch_worker* worker);
+    void    push_to_worker(dispatch_worker* worker, RdKafka::Message* message, kafka_offset_tracker* tracker = nullptr);
+    int32_t pin_partition(uint64_t partition_key);
+    bool    drain_workers(const std::vector<RdKafka::TopicPartition*>& partitions);
+    bool    dispatch_by_key_msg(RdKafka::Message* message);
+    bool    offsets_tracked() const;
+    bool    wait_expired() const;
+    int32_t consume_timeout_ms() const;
+    kafka_offset_tracker*   track_offset(RdKafka::Message* message);
+    void    complete_offset(kafka_offset_tracker* tracker, int64_t offset);
+    RdKafka::ErrorCode  flush_offsets(bool sync);
+    void    retire_offsets(const std::vector<RdKafka::TopicPartition*>& partitions);
+    RdKafka::ErrorCode  final_commit();
+    RdKafka::ErrorCode  close_consumer();
     void    log_msg(int32_t log_level, const char* format, ...);
 };
 
@@ -10,13 +10,39 @@
 #define __utility_common_kafka_default_define_hpp__
 
 #include "kafka_common.h"
+#include "kafka_hash.hpp"
+#include "kafka_json.hpp"
+#include "kafka_append_only_map.hpp"
 #include <rdkafkacpp.h>
+#include <rdkafka.h>
 #include <time.h>
+#include <string.h>
 #include <random>
 #include <functional>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <mutex>
+#include <algorithm>
 
 namespace utility
 {
+    /** 
+     * a partitioner implementing it is fed with the producer's statistics events(EVENT_STATS),
+     * the producer turns statistics.interval.ms on for it
+     */
+    class kafka_stats_observer
+    {
+    public:
+        virtual ~kafka_stats_observer() {}
+
+    public:
+        virtual void    on_stats(const std::string& stats_json) = 0;
+    };
+
     class munual_partitioner : public RdKafka::PartitionerCb 
     {
     protected:
@@ -35,11 +61,8 @@ namespace utility
 
     class random_partitioner : public RdKafka::PartitionerCb
     {
-    protected:
-        std::default_random_engine  m_rand_engine;
     public:
         random_partitioner(){
-            m_rand_engine.seed((uint32_t)time(NULL));
         }
 
     public:
@@ -53,15 +76,18 @@ namespace utility
         }
 
     protected:
-        int32_t rand_num(int32_t up) {
-            return std::uniform_int_distribution<int32_t>(0, up)(m_rand_engine);
+        /** called concurrently by the producing threads, so each thread has its own engine */
+        static int32_t rand_num(int32_t up) {
+            static thread_local std::default_random_engine rand_engine(
+                (uint32_t)time(NULL) ^ (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()));
+            return std::uniform_int_distribution<int32_t>(0, up)(rand_engine);
         }
     };
 
     class round_robin_partitioner : public RdKafka::PartitionerCb
     {
     protected:
-        int32_t m_cur_partition;
+        std::atomic<uint32_t>   m_cur_partition;
     public:
         round_robin_partitioner() : m_cur_partition(0) {
         }
@@ -69,14 +95,478 @@ namespace utility
     public:
         int32_t partitioner_cb(const RdKafka::Topic *topic, const std::string *key,
             int32_t partition_cnt, void *msg_opaque) override {
-            if (m_cur_partition >= partition_cnt) {
-                m_cur_partition = 0;
+            if (partition_cnt <= 0) {
+                return 0;
+            }
+
+            return (int32_t)(m_cur_partition.fetch_add(1, std::memory_order_relaxed) % (uint32_t)partition_cnt);
+        }
+    };
+
+    /** 
+     * keyless messages stick to one partition until batch_msg_count messages or linger_ms passed, 
+     * then switch to the next one, so that librdkafka builds bigger batches; 
+     * keyed messages are hashed by murmur2 as the java client does, or passed to keyed_partitioner if given.
+     * the partitioner sees no payload size, so the batch size is counted in messages; each topic sticks on its own
+     */
+    class sticky_partitioner : public RdKafka::PartitionerCb
+    {
+    protected:
+        /** shared by the producing threads */
+        struct sticky_state {
+            std::atomic<uint32_t>   sticky_partition;
+            std::atomic<int32_t>    msg_count;
+            std::atomic<int64_t>    switch_time_us;
+
+            sticky_state(uint32_t partition, int64_t switch_time)
+                : sticky_partition(partition)
+                , msg_count(0)
+                , switch_time_us(switch_time){
+            }
+        };
+
+        int32_t                 m_batch_msg_count;
+        int64_t                 m_linger_us;
+        RdKafka::PartitionerCb* m_keyed_partitioner;
+        murmur2_hash            m_key_hash;
+        /** the topic handles live as long as their producer, a lookup is lock-free */
+        kafka_append_only_map<const RdKafka::Topic*, sticky_state>  m_states;
+
+    public:
+        sticky_partitioner(int32_t batch_msg_count = 1000, int32_t linger_ms = 10, RdKafka::PartitionerCb* keyed_partitioner = nullptr)
+            : m_batch_msg_count(batch_msg_count > 0 ? batch_msg_count : 1)
+            , m_linger_us((int64_t)linger_ms * 1000)
+            , m_keyed_partitioner(keyed_partitioner){
+        }
+
+    public:
+        int32_t partitioner_cb(const RdKafka::Topic *topic, const std::string *key,
+            int32_t partition_cnt, void *msg_opaque) override {
+            if (partition_cnt <= 0) {
+                return 0;
+            }
+
+            if (key) {
+                if (m_keyed_partitioner) {
+                    return m_keyed_partitioner->partitioner_cb(topic, key, partition_cnt, msg_opaque);
+                }
+
+                return int32_t(m_key_hash(key->c_str(), key->size()) % (uint32_t)partition_cnt);
+            }
+
+            sticky_state* state = m_states.find(topic);
+            if (!state) {
+                state = m_states.get_or_create(topic, [this](const RdKafka::Topic* const& rk_topic) {
+                    // the topics do not all start on the same partition
+                    uint32_t start_partition = (uint32_t)time(NULL) + (uint32_t)((uintptr_t)rk_topic >> 4);
+                    return new sticky_state(start_partition, now_us() + m_linger_us);
+                });
+            }
+
+            uint32_t partition = state->sticky_partition.load(std::memory_order_relaxed);
+            int32_t msg_count = state->msg_count.fetch_add(1, std::memory_order_relaxed) + 1;
+
+            if (msg_count >= m_batch_msg_count || now_us() >= state->switch_time_us.load(std::memory_order_relaxed)) {
+                // only the thread winning the cas switches, the others keep the old partition for this message
+                if (state->sticky_partition.compare_exchange_strong(partition, partition + 1, std::memory_order_relaxed)) {
+                    state->msg_count.store(0, std::memory_order_relaxed);
+                    state->switch_time_us.store(now_us() + m_linger_us, std::memory_order_relaxed);
+                }
+            }
+
+            return int32_t(partition % (uint32_t)partition_cnt);
+        }
+
+    protected:
+        static int64_t now_us() {
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+    };
+
+
+    /** 
+     * hash partitioner with the hash functor inlined, keyless messages go to a sticky_partitioner;
+     * murmur2_partitioner places the keys on the same partitions as the java client
+     */
+    template<typename Hash>
+    class hash_partitioner : public RdKafka::PartitionerCb
+    {
+    protected:
+        Hash                m_hash;
+        sticky_partitioner  m_keyless_partitioner;
+
+    public:
+        hash_partitioner(int32_t keyless_batch_msg_count = 1000, int32_t keyless_linger_ms = 10)
+            : m_keyless_partitioner(keyless_batch_msg_count, keyless_linger_ms){
+        }
+
+    public:
+        int32_t partitioner_cb(const RdKafka::Topic *topic, const std::string *key,
+            int32_t partition_cnt, void *msg_opaque) override {
+            if (partition_cnt <= 0) {
+                return 0;
+            }
+
+            if (!key) {
+                return m_keyless_partitioner.partitioner_cb(topic, key, partition_cnt, msg_opaque);
             }
 
-            return m_cur_partition++;
+            return int32_t(m_hash(key->c_str(), key->size()) % (uint32_t)partition_cnt);
         }
     };
 
+    typedef hash_partitioner<murmur2_hash>  murmur2_partitioner;
+    typedef hash_partitioner<crc32c_hash>   crc32c_partitioner;
+    typedef hash_partitioner<xxhash32_hash> xxhash32_partitioner;
+    typedef hash_partitioner<djb_hash>      djb_partitioner;
+
+    /** 
+     * keyless messages are spread by weights built from the statistics: a partition gets less 
+     * traffic when its local queue(msgq_cnt + xmit_msgq_cnt) is deeper, or its leader's rtt is higher,
+     * than the topic average; partitions whose leader is not UP get none.
+     * keyed messages are placed by murmur2 as the java client does.
+     * the weights are an immutable snapshot swapped on each statistics event, 
+     * so partitioner_cb is a hash lookup plus a table pick; it pins the snapshot on a counter
+     * of its own thread stripe, and the statistics thread frees a replaced one once no stripe counts it
+     */
+    class load_aware_partitioner : 
+        public RdKafka::PartitionerCb,
+        public kafka_stats_observer
+    {
+    protected:
+        enum {
+            weight_table_size = 256,
+            reader_stripe_count = 16,
+            cache_line_size = 64,
+        };
+
+        /** the partitioner_cb in progress of the threads of a stripe, by the parity of m_epoch they started in */
+        struct reader_stripe {
+            std::atomic<int32_t>    counts[2];
+            char                    pad[cache_line_size - 2 * sizeof(std::atomic<int32_t>)];
+        };
+
+        struct topic_weights {
+            std::string             name;
+            int32_t                 partition_cnt;
+            /** partitions repeated in proportion to their weights */
+            std::vector<int32_t>    table;
+        };
+
+        struct weights_snapshot {
+            /* <fnv hash of topic name, weights> */
+            std::unordered_map<uint64_t, topic_weights> topics;
+        };
+
+        struct partition_load {
+            int32_t partition;
+            double  depth;
+            double  rtt;
+            bool    available;
+        };
+
+        /* <topic name, partition loads> */
+        typedef std::map<std::string, std::vector<partition_load>> topic_loads;
+
+        struct source_loads {
+            int64_t     update_time_ms;
+            int64_t     interval_ms;
+            topic_loads topics;
+        };
+
+        /** replaced under m_sources_mtx, freed once the readers that might hold it are gone, see publish */
+        std::atomic<const weights_snapshot*>    m_snapshot;
+        std::atomic<uint32_t>                   m_epoch;
+        char                                    m_pad[cache_line_size];
+        reader_stripe                           m_readers[reader_stripe_count];
+        murmur2_hash                            m_key_hash;
+
+        /** 
+         * <stats name of the producer, its last loads>, the producers sharing the partitioner
+         * (e.g. the shards of a kafka_producer_group) are weighted by their merged loads
+         */
+        std::mutex                              m_sources_mtx;
+        std::map<std::string, source_loads>     m_sources;
+
+    public:
+        load_aware_partitioner() 
+            : m_snapshot(nullptr)
+            , m_epoch(0){
+            for (auto& stripe : m_readers) {
+                stripe.counts[0].store(0, std::memory_order_relaxed);
+                stripe.counts[1].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        ~load_aware_partitioner() {
+            delete m_snapshot.load();
+        }
+
+        load_aware_partitioner(const load_aware_partitioner&) = delete;
+        load_aware_partitioner& operator=(const load_aware_partitioner&) = delete;
+
+    public:
+        int32_t partitioner_cb(const RdKafka::Topic *topic, const std::string *key,
+            int32_t partition_cnt, void *msg_opaque) override {
+            if (partition_cnt <= 0) {
+                return 0;
+            }
+
+            if (key) {
+                return int32_t(m_key_hash(key->c_str(), key->size()) % (uint32_t)partition_cnt);
+            }
+
+            int32_t partition = -1;
+            if (topic) {
+                reader_stripe& stripe = m_readers[reader_stripe_index()];
+                uint32_t parity = m_epoch.load() & 1;
+                stripe.counts[parity].fetch_add(1);
+
+                const weights_snapshot* snapshot = m_snapshot.load();
+                if (snapshot) {
+                    const char* topic_name = rd_kafka_topic_name(const_cast<RdKafka::Topic*>(topic)->c_ptr());
+                    auto iter = snapshot->topics.find(name_hash(topic_name, strlen(topic_name)));
+                    if (iter != snapshot->topics.end() 
+                        && iter->second.partition_cnt == partition_cnt
+                        && iter->second.name == topic_name) {
+                        auto& table = iter->second.table;
+                        partition = table[rand_num() % table.size()];
+                    }
+                }
+
+                stripe.counts[parity].fetch_sub(1, std::memory_order_release);
+            }
+
+            return partition >= 0 ? partition : int32_t(rand_num() % (uint32_t)partition_cnt);
+        }
+
+        /** implement the interface from kafka_stats_observer */
+        void    on_stats(const std::string& stats_json) override {
+            kafka_json_value stats;
+            if (!kafka_json_value::parse(stats_json, &stats)) {
+                return;
+            }
+
+            int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+
+            // the merge and the publish are ordered by the lock, a stale merge never replaces a newer one
+            std::lock_guard<std::mutex> locker(m_sources_mtx);
+            auto source_iter = m_sources.find(stats["name"].as_string());
+            if (source_iter == m_sources.end()) {
+                source_iter = m_sources.insert(std::make_pair(stats["name"].as_string(), source_loads())).first;
+                source_iter->second.interval_ms = 0;
+            }
+            else {
+                source_iter->second.interval_ms = now - source_iter->second.update_time_ms;
+            }
+
+            source_iter->second.update_time_ms = now;
+            source_iter->second.topics.clear();
+            parse_loads(stats, &source_iter->second.topics);
+
+            // a producer which has not sent stats for a few intervals is gone
+            for (auto iter = m_sources.begin(); iter != m_sources.end();) {
+                if (now - iter->second.update_time_ms > 3 * (std::max)(iter->second.interval_ms, (int64_t)1000)) {
+                    iter = m_sources.erase(iter);
+                }
+                else {
+                    ++iter;
+                }
+            }
+
+            topic_loads merged;
+            merge_loads(m_sources, &merged);
+            publish(build_snapshot(merged));
+        }
+
+    protected:
+        /** 
+         * called with m_sources_mtx locked. as in userspace rcu, the epoch is flipped twice and the readers 
+         * counted under each parity are waited for; a reader which started before the swap is counted 
+         * under one of them, a reader which starts after it loads the new snapshot
+         */
+        void    publish(const weights_snapshot* snapshot) {
+            const weights_snapshot* old_snapshot = m_snapshot.exchange(snapshot);
+            if (!old_snapshot) {
+                return;
+            }
+
+            for (int32_t flip = 0; flip < 2; ++flip) {
+                uint32_t parity = m_epoch.fetch_add(1) & 1;
+                for (auto& stripe : m_readers) {
+                    while (stripe.counts[parity].load(std::memory_order_acquire) != 0) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+
+            delete old_snapshot;
+        }
+
+        static size_t reader_stripe_index() {
+            static std::atomic<uint32_t> next_stripe(0);
+            static thread_local size_t stripe = next_stripe++ % reader_stripe_count;
+            return stripe;
+        }
+
+        static void parse_loads(const kafka_json_value& stats, topic_loads* topics) {
+            // <broker node id, rtt avg in us>, -1 if the broker is not up
+            std::unordered_map<int64_t, double> broker_rtts;
+            for (auto& broker : stats["brokers"].members()) {
+                const kafka_json_value& broker_stats = broker.second;
+                double rtt = broker_stats["state"].as_string() == "UP" ? broker_stats["rtt"]["avg"].as_number() : -1;
+                broker_rtts[broker_stats["nodeid"].as_int(-1)] = rtt;
+            }
+
+            for (auto& topic : stats["topics"].members()) {
+                std::vector<partition_load>& loads = (*topics)[topic.first];
+                for (auto& partition : topic.second["partitions"].members()) {
+                    const kafka_json_value& partition_stats = partition.second;
+                    partition_load load;
+                    load.partition = (int32_t)partition_stats["partition"].as_int(-1);
+
+                    // the -1 partition is the unassigned queue
+                    if (load.partition < 0) {
+                        continue;
+                    }
+
+                    load.depth = partition_stats["msgq_cnt"].as_number() + partition_stats["xmit_msgq_cnt"].as_number();
+                    auto rtt_iter = broker_rtts.find(partition_stats["leader"].as_int(-1));
+                    load.rtt = rtt_iter != broker_rtts.end() ? rtt_iter->second : -1;
+                    load.available = load.rtt >= 0;
+                    loads.push_back(load);
+                }
+            }
+        }
+
+        /** the queue depths of a partition are summed up, its rtt is the mean of the producers which have the leader up */
+        static void merge_loads(const std::map<std::string, source_loads>& sources, topic_loads* merged) {
+            // <topic name, <partition, <summed load, count of the producers with the leader up>>>
+            std::map<std::string, std::map<int32_t, std::pair<partition_load, int32_t>>> sums;
+            for (auto& source : sources) {
+                for (auto& topic : source.second.topics) {
+                    for (auto& load : topic.second) {
+                        std::pair<partition_load, int32_t>& sum = sums[topic.first][load.partition];
+                        sum.first.partition = load.partition;
+                        sum.first.depth += load.depth;
+                        if (load.available) {
+                            sum.first.rtt += load.rtt;
+                            ++sum.second;
+                        }
+                    }
+                }
+            }
+
+            for (auto& topic : sums) {
+                std::vector<partition_load>& loads = (*merged)[topic.first];
+                for (auto& partition : topic.second) {
+                    partition_load load = partition.second.first;
+                    load.available = partition.second.second > 0;
+                    load.rtt = load.available ? load.rtt / partition.second.second : -1;
+                    loads.push_back(load);
+                }
+            }
+        }
+
+        static weights_snapshot* build_snapshot(const topic_loads& topics) {
+            weights_snapshot* snapshot = new weights_snapshot();
+
+            for (auto& topic : topics) {
+                const std::vector<partition_load>& loads = topic.second;
+                double total_depth = 0;
+                double total_rtt = 0;
+                int32_t available_count = 0;
+
+                for (auto& load : loads) {
+                    if (load.available) {
+                        total_depth += load.depth;
+                        total_rtt += load.rtt;
+                        ++available_count;
+                    }
+                }
+
+                if (loads.empty() || available_count == 0) {
+                    continue;
+                }
+
+                int32_t partition_cnt = 0;
+                for (auto& load : loads) {
+                    if (load.partition + 1 > partition_cnt) {
+                        partition_cnt = load.partition + 1;
+                    }
+                }
+
+                double mean_depth = total_depth / available_count;
+                double mean_rtt = total_rtt / available_count;
+
+                std::vector<double> weights(loads.size(), 0);
+                double total_weight = 0;
+                double max_weight = 0;
+                for (size_t i = 0; i < loads.size(); ++i) {
+                    if (!loads[i].available) {
+                        continue;
+                    }
+
+                    double load = loads[i].depth / (mean_depth > 1 ? mean_depth : 1) 
+                        + loads[i].rtt / (mean_rtt > 1 ? mean_rtt : 1);
+                    weights[i] = 1.0 / ((1.0 + load) * (1.0 + load));
+                    if (weights[i] > max_weight) {
+                        max_weight = weights[i];
+                    }
+                }
+
+                // keep a trickle to the lagging partitions so that they are noticed when they recover
+                for (size_t i = 0; i < loads.size(); ++i) {
+                    if (loads[i].available && weights[i] < max_weight * 0.01) {
+                        weights[i] = max_weight * 0.01;
+                    }
+                    total_weight += weights[i];
+                }
+
+                topic_weights& topic_weight = snapshot->topics[name_hash(topic.first.c_str(), topic.first.size())];
+                topic_weight.name = topic.first;
+                topic_weight.partition_cnt = partition_cnt;
+
+                size_t table_size = weight_table_size;
+                if (table_size < loads.size() * 4) {
+                    table_size = loads.size() * 4;
+                }
+
+                for (size_t i = 0; i < loads.size(); ++i) {
+                    size_t slot_count = (size_t)(weights[i] / total_weight * table_size + 0.5);
+                    topic_weight.table.insert(topic_weight.table.end(), slot_count, loads[i].partition);
+                }
+
+                if (topic_weight.table.empty()) {
+                    snapshot->topics.erase(name_hash(topic.first.c_str(), topic.first.size()));
+                }
+            }
+
+            return snapshot;
+        }
+
+        static uint64_t name_hash(const char* name, size_t len) {
+            // FNV-1a
+            uint64_t hash = 14695981039346656037ull;
+            for (size_t i = 0; i < len; ++i) {
+                hash ^= (uint8_t)name[i];
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+
+        static uint32_t rand_num() {
+            // xorshift32, one state per producing thread
+            static thread_local uint32_t state = (uint32_t)time(NULL) 
+                ^ (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id()) ^ 0x9e3779b9;
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            return state;
+        }
+    };
 
     class custom_hash_partitioner : public RdKafka::PartitionerCb
     {
@@ -88,7 +578,7 @@ namespace utility
 
     public:
         custom_hash_partitioner(){
-            m_hash_func = custom_hash_partitioner::djb_hash;
+            m_hash_func = djb_hash();
         }
 
         custom_hash_partitioner(const hash_func_type& func) 
@@ -109,14 +599,6 @@ namespace utility
             uint32_t hash_code = (m_hash_func)(key->c_str(), (int32_t)key->size());
             return int32_t(hash_code % partition_cnt);
         }
-
-    protected:
-        static inline uint32_t djb_hash(const char *str, size_t len) {
-            uint32_t hash = 5381;
-            for (size_t i = 0; i < len; i++)
-                hash = ((hash << 5) + hash) + str[i];
-            return hash;
-        }
     };
 
 } // end namespace utility
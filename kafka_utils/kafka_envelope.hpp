@@ -0,0 +1,143 @@
+﻿/**
+ * @brief kafka record envelope
+ *
+ * many small records packed into one kafka message, see kafka_msg_packer;
+ * layout: magic(4 bytes: 0xce 'k' 'e' version) followed by the records, each a varint length and the bytes;
+ * the message is marked by the header_name() header, only a marked payload that parses to the last byte
+ * is taken as an envelope, so a plain message starting with the same bytes is never split
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-31
+ */
+
+#ifndef __utility_common_kafka_envelope_hpp__
+#define __utility_common_kafka_envelope_hpp__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <rdkafka.h>
+
+namespace utility
+{
+
+class kafka_envelope
+{
+public:
+    enum {
+        magic_size = 4,
+        max_varint_size = 5,
+    };
+
+    static const char* magic() {
+        static const char magic_bytes[magic_size] = { (char)0xce, 'k', 'e', 1 };
+        return magic_bytes;
+    }
+
+    /** kafka message header set by kafka_producer::produce_envelope_move */
+    static const char* header_name() {
+        return "kafka_utils.envelope";
+    }
+
+    /** the message carries the envelope header; the headers are parsed by librdkafka at the first call */
+    static bool marked(const rd_kafka_message_t* rkmessage) {
+        rd_kafka_headers_t* headers = nullptr;
+        if (rd_kafka_message_headers(rkmessage, &headers) != RD_KAFKA_RESP_ERR_NO_ERROR) {
+            return false;
+        }
+
+        const void* value = nullptr;
+        size_t size = 0;
+        return rd_kafka_header_get_last(headers, header_name(), &value, &size) == RD_KAFKA_RESP_ERR_NO_ERROR;
+    }
+
+    /** start an empty envelope in buffer */
+    static void begin(std::string& buffer) {
+        buffer.assign(magic(), magic_size);
+    }
+
+    /** append one record to an envelope started by begin */
+    static void append(std::string& buffer, const char* record, uint32_t len) {
+        char varint[max_varint_size];
+        size_t varint_len = 0;
+
+        uint32_t value = len;
+        while (value >= 0x80) {
+            varint[varint_len++] = (char)(value | 0x80);
+            value >>= 7;
+        }
+        varint[varint_len++] = (char)value;
+
+        buffer.append(varint, varint_len);
+        buffer.append(record, len);
+    }
+
+    /** bytes a record adds to the envelope */
+    static size_t record_size(uint32_t len) {
+        size_t size = 1;
+        for (uint32_t value = len; value >= 0x80; value >>= 7) {
+            ++size;
+        }
+        return size + len;
+    }
+
+    /** 
+     * call visitor(const char* record, int32_t len) for each record of the envelope;
+     * returns false, without calling visitor, if data is not an envelope
+     */
+    template<typename Visitor>
+    static bool unpack(const char* data, size_t len, Visitor&& visitor) {
+        if (!is_envelope(data, len)) {
+            return false;
+        }
+
+        size_t pos = magic_size;
+        while (pos < len) {
+            uint32_t record_len = 0;
+            pos += read_varint(data + pos, len - pos, &record_len);
+            visitor(data + pos, (int32_t)record_len);
+            pos += record_len;
+        }
+
+        return true;
+    }
+
+    /** checks the magic and that the records end exactly at len */
+    static bool is_envelope(const char* data, size_t len) {
+        if (!data || len <= magic_size || memcmp(data, magic(), magic_size) != 0) {
+            return false;
+        }
+
+        size_t pos = magic_size;
+        while (pos < len) {
+            uint32_t record_len = 0;
+            size_t varint_len = read_varint(data + pos, len - pos, &record_len);
+            if (varint_len == 0 || record_len > len - pos - varint_len) {
+                return false;
+            }
+            pos += varint_len + record_len;
+        }
+
+        return true;
+    }
+
+protected:
+    /** returns the bytes read, 0 if the varint is truncated or too long */
+    static size_t read_varint(const char* data, size_t len, uint32_t* value) {
+        uint32_t result = 0;
+        for (size_t i = 0; i < len && i < max_varint_size; ++i) {
+            uint8_t byte = (uint8_t)data[i];
+            result |= (uint32_t)(byte & 0x7f) << (7 * i);
+            if (!(byte & 0x80)) {
+                *value = result;
+                return i + 1;
+            }
+        }
+
+        return 0;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,231 @@
+﻿/**
+ * @brief hash functors for the hash partitioners
+ *
+ * murmur2_hash    : same as the java client's default partitioner
+ * crc32c_hash     : sse4.2/armv8 crc instructions when the target has them
+ * xxhash32_hash   : xxHash32 with seed 0
+ * djb_hash        : the former custom_hash_partitioner default
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-06-03
+ */
+
+#ifndef __utility_common_kafka_hash_hpp__
+#define __utility_common_kafka_hash_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE4_2__) || (defined(_MSC_VER) && defined(__AVX__))
+#include <nmmintrin.h>
+#define KAFKA_HASH_CRC32C_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define KAFKA_HASH_CRC32C_ARMV8
+#endif
+
+namespace utility
+{
+    struct djb_hash
+    {
+        uint32_t operator()(const char* data, size_t len) const {
+            uint32_t hash = 5381;
+            for (size_t i = 0; i < len; i++)
+                hash = ((hash << 5) + hash) + data[i];
+            return hash;
+        }
+    };
+
+    /** org.apache.kafka.common.utils.Utils.murmur2, made positive as the java partitioner does */
+    struct murmur2_hash
+    {
+        uint32_t operator()(const char* data, size_t len) const {
+            const uint32_t seed = 0x9747b28c;
+            const uint32_t m = 0x5bd1e995;
+            const int32_t r = 24;
+            const uint8_t* bytes = (const uint8_t*)data;
+
+            uint32_t h = seed ^ (uint32_t)len;
+            size_t length4 = len / 4;
+
+            for (size_t i = 0; i < length4; i++) {
+                size_t i4 = i * 4;
+                uint32_t k = (uint32_t)bytes[i4 + 0] | ((uint32_t)bytes[i4 + 1] << 8) 
+                    | ((uint32_t)bytes[i4 + 2] << 16) | ((uint32_t)bytes[i4 + 3] << 24);
+                k *= m;
+                k ^= k >> r;
+                k *= m;
+                h *= m;
+                h ^= k;
+            }
+
+            size_t tail = len & ~(size_t)3;
+            switch (len % 4) {
+            case 3:
+                h ^= (uint32_t)bytes[tail + 2] << 16;
+                // fall through
+            case 2:
+                h ^= (uint32_t)bytes[tail + 1] << 8;
+                // fall through
+            case 1:
+                h ^= (uint32_t)bytes[tail];
+                h *= m;
+            }
+
+            h ^= h >> 13;
+            h *= m;
+            h ^= h >> 15;
+
+            return h & 0x7fffffff;
+        }
+    };
+
+    struct crc32c_hash
+    {
+        uint32_t operator()(const char* data, size_t len) const {
+            uint32_t crc = 0xffffffff;
+            const uint8_t* bytes = (const uint8_t*)data;
+
+#if defined(KAFKA_HASH_CRC32C_SSE42) && (defined(__x86_64__) || defined(_M_X64))
+            for (; len >= 8; len -= 8, bytes += 8) {
+                uint64_t word;
+                memcpy(&word, bytes, sizeof(word));
+                crc = (uint32_t)_mm_crc32_u64(crc, word);
+            }
+            for (; len > 0; --len, ++bytes) {
+                crc = _mm_crc32_u8(crc, *bytes);
+            }
+#elif defined(KAFKA_HASH_CRC32C_SSE42)
+            for (; len >= 4; len -= 4, bytes += 4) {
+                uint32_t word;
+                memcpy(&word, bytes, sizeof(word));
+                crc = _mm_crc32_u32(crc, word);
+            }
+            for (; len > 0; --len, ++bytes) {
+                crc = _mm_crc32_u8(crc, *bytes);
+            }
+#elif defined(KAFKA_HASH_CRC32C_ARMV8)
+            for (; len >= 8; len -= 8, bytes += 8) {
+                uint64_t word;
+                memcpy(&word, bytes, sizeof(word));
+                crc = __crc32cd(crc, word);
+            }
+            for (; len > 0; --len, ++bytes) {
+                crc = __crc32cb(crc, *bytes);
+            }
+#else
+            const uint32_t* table = crc32c_table();
+            for (; len > 0; --len, ++bytes) {
+                crc = table[(crc ^ *bytes) & 0xff] ^ (crc >> 8);
+            }
+#endif
+
+            return crc ^ 0xffffffff;
+        }
+
+        /** true if the crc instructions are compiled in */
+        static bool hardware_accelerated() {
+#if defined(KAFKA_HASH_CRC32C_SSE42) || defined(KAFKA_HASH_CRC32C_ARMV8)
+            return true;
+#else
+            return false;
+#endif
+        }
+
+    protected:
+        static const uint32_t* crc32c_table() {
+            struct table_type {
+                uint32_t values[256];
+
+                table_type() {
+                    for (uint32_t i = 0; i < 256; ++i) {
+                        uint32_t crc = i;
+                        for (int32_t j = 0; j < 8; ++j) {
+                            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+                        }
+                        values[i] = crc;
+                    }
+                }
+            };
+
+            static const table_type table;
+            return table.values;
+        }
+    };
+
+    struct xxhash32_hash
+    {
+        uint32_t operator()(const char* data, size_t len) const {
+            const uint8_t* p = (const uint8_t*)data;
+            const uint8_t* end = p + len;
+            uint32_t h32;
+
+            if (len >= 16) {
+                const uint8_t* limit = end - 16;
+                uint32_t v1 = prime1 + prime2;
+                uint32_t v2 = prime2;
+                uint32_t v3 = 0;
+                uint32_t v4 = 0 - prime1;
+
+                do {
+                    v1 = round(v1, read32(p));
+                    v2 = round(v2, read32(p + 4));
+                    v3 = round(v3, read32(p + 8));
+                    v4 = round(v4, read32(p + 12));
+                    p += 16;
+                } while (p <= limit);
+
+                h32 = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            }
+            else {
+                h32 = prime5;
+            }
+
+            h32 += (uint32_t)len;
+
+            for (; p + 4 <= end; p += 4) {
+                h32 += read32(p) * prime3;
+                h32 = rotl(h32, 17) * prime4;
+            }
+
+            for (; p < end; ++p) {
+                h32 += (*p) * prime5;
+                h32 = rotl(h32, 11) * prime1;
+            }
+
+            h32 ^= h32 >> 15;
+            h32 *= prime2;
+            h32 ^= h32 >> 13;
+            h32 *= prime3;
+            h32 ^= h32 >> 16;
+
+            return h32;
+        }
+
+    protected:
+        static const uint32_t prime1 = 2654435761U;
+        static const uint32_t prime2 = 2246822519U;
+        static const uint32_t prime3 = 3266489917U;
+        static const uint32_t prime4 = 668265263U;
+        static const uint32_t prime5 = 374761393U;
+
+        static inline uint32_t rotl(uint32_t x, int32_t r) {
+            return (x << r) | (x >> (32 - r));
+        }
+
+        static inline uint32_t read32(const uint8_t* p) {
+            return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+
+        static inline uint32_t round(uint32_t acc, uint32_t input) {
+            acc += input * prime2;
+            acc = rotl(acc, 13);
+            acc *= prime1;
+            return acc;
+        }
+    };
+
+} // end namespace utility
+
+#endif
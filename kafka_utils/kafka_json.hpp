@@ -0,0 +1,284 @@
+﻿/**
+ * @brief minimal json reader
+ *
+ * just enough to read the librdkafka statistics document (EVENT_STATS), 
+ * numbers are kept as double and strings are not unescaped beyond the simple escapes
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-06-10
+ */
+
+#ifndef __utility_common_kafka_json_hpp__
+#define __utility_common_kafka_json_hpp__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+namespace utility
+{
+
+class kafka_json_value
+{
+public:
+    enum value_type {
+        type_null,
+        type_bool,
+        type_number,
+        type_string,
+        type_array,
+        type_object,
+    };
+
+    typedef std::map<std::string, kafka_json_value> object_type;
+    typedef std::vector<kafka_json_value> array_type;
+
+protected:
+    value_type                      m_type;
+    double                          m_number;
+    std::string                     m_string;
+    std::shared_ptr<array_type>     m_array;
+    std::shared_ptr<object_type>    m_object;
+
+public:
+    kafka_json_value() : m_type(type_null), m_number(0) {
+    }
+
+public:
+    value_type  type() const { return m_type; }
+    bool        is_null() const { return m_type == type_null; }
+    bool        is_object() const { return m_type == type_object; }
+    bool        is_array() const { return m_type == type_array; }
+
+    double      as_number(double default_value = 0) const {
+        return m_type == type_number || m_type == type_bool ? m_number : default_value;
+    }
+
+    int64_t     as_int(int64_t default_value = 0) const {
+        return m_type == type_number || m_type == type_bool ? (int64_t)m_number : default_value;
+    }
+
+    const std::string& as_string() const { return m_string; }
+
+    /** member of an object, a null value if absent */
+    const kafka_json_value& operator[](const std::string& name) const {
+        static const kafka_json_value null_value;
+        if (m_type != type_object) {
+            return null_value;
+        }
+
+        auto iter = m_object->find(name);
+        return iter != m_object->end() ? iter->second : null_value;
+    }
+
+    const object_type& members() const {
+        static const object_type empty_object;
+        return m_type == type_object ? *m_object : empty_object;
+    }
+
+    const array_type& elements() const {
+        static const array_type empty_array;
+        return m_type == type_array ? *m_array : empty_array;
+    }
+
+public:
+    /** returns false on malformed input */
+    static bool parse(const std::string& text, kafka_json_value* value) {
+        const char* p = text.c_str();
+        const char* end = p + text.size();
+        if (!parse_value(p, end, value)) {
+            return false;
+        }
+
+        skip_space(p, end);
+        return p == end;
+    }
+
+protected:
+    static void skip_space(const char*& p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+            ++p;
+        }
+    }
+
+    static bool parse_value(const char*& p, const char* end, kafka_json_value* value) {
+        skip_space(p, end);
+        if (p >= end) {
+            return false;
+        }
+
+        switch (*p) {
+        case '{':
+            return parse_object(p, end, value);
+        case '[':
+            return parse_array(p, end, value);
+        case '"':
+            value->m_type = type_string;
+            return parse_string(p, end, &value->m_string);
+        case 't':
+            value->m_type = type_bool;
+            value->m_number = 1;
+            return parse_literal(p, end, "true");
+        case 'f':
+            value->m_type = type_bool;
+            value->m_number = 0;
+            return parse_literal(p, end, "false");
+        case 'n':
+            value->m_type = type_null;
+            return parse_literal(p, end, "null");
+        default:
+            return parse_number(p, end, value);
+        }
+    }
+
+    static bool parse_literal(const char*& p, const char* end, const char* literal) {
+        for (; *literal; ++literal, ++p) {
+            if (p >= end || *p != *literal) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool parse_number(const char*& p, const char* end, kafka_json_value* value) {
+        char* num_end = nullptr;
+        value->m_number = strtod(p, &num_end);
+        if (num_end == p || num_end > end) {
+            return false;
+        }
+
+        value->m_type = type_number;
+        p = num_end;
+        return true;
+    }
+
+    static bool parse_string(const char*& p, const char* end, std::string* str) {
+        // skip the opening quote
+        ++p;
+        while (p < end && *p != '"') {
+            if (*p == '\\') {
+                if (++p >= end) {
+                    return false;
+                }
+
+                switch (*p) {
+                case 'n': str->push_back('\n'); break;
+                case 't': str->push_back('\t'); break;
+                case 'r': str->push_back('\r'); break;
+                case 'b': str->push_back('\b'); break;
+                case 'f': str->push_back('\f'); break;
+                case 'u':
+                    // not decoded, the statistics names are plain ascii
+                    str->append("\\u");
+                    break;
+                default: str->push_back(*p); break;
+                }
+                ++p;
+                continue;
+            }
+
+            str->push_back(*p++);
+        }
+
+        if (p >= end) {
+            return false;
+        }
+
+        ++p;
+        return true;
+    }
+
+    static bool parse_array(const char*& p, const char* end, kafka_json_value* value) {
+        value->m_type = type_array;
+        value->m_array = std::make_shared<array_type>();
+
+        ++p;
+        skip_space(p, end);
+        if (p < end && *p == ']') {
+            ++p;
+            return true;
+        }
+
+        while (true) {
+            value->m_array->push_back(kafka_json_value());
+            if (!parse_value(p, end, &value->m_array->back())) {
+                return false;
+            }
+
+            skip_space(p, end);
+            if (p >= end) {
+                return false;
+            }
+
+            if (*p == ',') {
+                ++p;
+                continue;
+            }
+
+            if (*p == ']') {
+                ++p;
+                return true;
+            }
+
+            return false;
+        }
+    }
+
+    static bool parse_object(const char*& p, const char* end, kafka_json_value* value) {
+        value->m_type = type_object;
+        value->m_object = std::make_shared<object_type>();
+
+        ++p;
+        skip_space(p, end);
+        if (p < end && *p == '}') {
+            ++p;
+            return true;
+        }
+
+        while (true) {
+            skip_space(p, end);
+            if (p >= end || *p != '"') {
+                return false;
+            }
+
+            std::string name;
+            if (!parse_string(p, end, &name)) {
+                return false;
+            }
+
+            skip_space(p, end);
+            if (p >= end || *p != ':') {
+                return false;
+            }
+            ++p;
+
+            if (!parse_value(p, end, &(*value->m_object)[name])) {
+                return false;
+            }
+
+            skip_space(p, end);
+            if (p >= end) {
+                return false;
+            }
+
+            if (*p == ',') {
+                ++p;
+                continue;
+            }
+
+            if (*p == '}') {
+                ++p;
+                return true;
+            }
+
+            return false;
+        }
+    }
+};
+
+} // end namespace utility
+
+#endif
@@ -0,0 +1,218 @@
+﻿/**
+ * @brief kafka latency histogram
+ *
+ * lock-free log-linear (HDR style) histogram of latencies in microseconds,
+ * every power of two range is split into 32 linear sub buckets, so the relative error is about 3%
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-28
+ */
+
+#ifndef __utility_common_kafka_latency_histogram_hpp__
+#define __utility_common_kafka_latency_histogram_hpp__
+
+#include <stdint.h>
+#include <atomic>
+#include <algorithm>
+
+namespace utility
+{
+
+struct kafka_latency_snapshot
+{
+    int64_t     count;
+    int64_t     min_us;
+    int64_t     max_us;
+    int64_t     mean_us;
+    int64_t     p50_us;
+    int64_t     p99_us;
+    int64_t     p999_us;
+
+    kafka_latency_snapshot()
+        : count(0)
+        , min_us(0)
+        , max_us(0)
+        , mean_us(0)
+        , p50_us(0)
+        , p99_us(0)
+        , p999_us(0){
+    }
+};
+
+class kafka_latency_histogram
+{
+public:
+    enum {
+        sub_bucket_bits = 5,
+        sub_bucket_count = 1 << sub_bucket_bits,
+        /** values above 2^max_value_bits us(about 12 days) are clamped */
+        max_value_bits = 40,
+        bucket_count = 2 * sub_bucket_count + (max_value_bits - sub_bucket_bits - 1) * sub_bucket_count,
+    };
+
+protected:
+    std::atomic<uint64_t>   m_buckets[bucket_count];
+    std::atomic<int64_t>    m_count;
+    std::atomic<int64_t>    m_sum;
+    std::atomic<int64_t>    m_min;
+    std::atomic<int64_t>    m_max;
+
+public:
+    kafka_latency_histogram() {
+        reset();
+    }
+
+    /** record one latency, thread safe and wait-free except for the min/max update */
+    void    record(int64_t latency_us) {
+        if (latency_us < 0) {
+            return;
+        }
+
+        m_buckets[bucket_index(latency_us)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(latency_us, std::memory_order_relaxed);
+
+        int64_t cur = m_max.load(std::memory_order_relaxed);
+        while (latency_us > cur && !m_max.compare_exchange_weak(cur, latency_us, std::memory_order_relaxed)) {
+        }
+
+        cur = m_min.load(std::memory_order_relaxed);
+        while (latency_us < cur && !m_min.compare_exchange_weak(cur, latency_us, std::memory_order_relaxed)) {
+        }
+    }
+
+    /** percentiles are the upper bound of the bucket they fall in; concurrent records may be partly seen */
+    kafka_latency_snapshot  snapshot() const {
+        kafka_latency_snapshot snap;
+
+        uint64_t counts[bucket_count];
+        uint64_t total = 0;
+        for (int32_t i = 0; i < bucket_count; ++i) {
+            counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+
+        if (total == 0) {
+            return snap;
+        }
+
+        snap.count = (int64_t)total;
+        snap.min_us = m_min.load(std::memory_order_relaxed);
+        snap.max_us = m_max.load(std::memory_order_relaxed);
+        snap.mean_us = m_sum.load(std::memory_order_relaxed) / (std::max)(m_count.load(std::memory_order_relaxed), (int64_t)1);
+        snap.p50_us = value_at(counts, total, 0.5, snap.max_us);
+        snap.p99_us = value_at(counts, total, 0.99, snap.max_us);
+        snap.p999_us = value_at(counts, total, 0.999, snap.max_us);
+        return snap;
+    }
+
+    /** adds the records of other, e.g. of the same topic in another producer; concurrent records may be partly seen */
+    void    merge(const kafka_latency_histogram& other) {
+        int64_t count = 0;
+        for (int32_t i = 0; i < bucket_count; ++i) {
+            uint64_t bucket = other.m_buckets[i].load(std::memory_order_relaxed);
+            if (bucket > 0) {
+                m_buckets[i].fetch_add(bucket, std::memory_order_relaxed);
+                count += (int64_t)bucket;
+            }
+        }
+
+        if (count == 0) {
+            return;
+        }
+
+        m_count.fetch_add(count, std::memory_order_relaxed);
+        m_sum.fetch_add(other.m_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+        int64_t other_max = other.m_max.load(std::memory_order_relaxed);
+        int64_t cur = m_max.load(std::memory_order_relaxed);
+        while (other_max > cur && !m_max.compare_exchange_weak(cur, other_max, std::memory_order_relaxed)) {
+        }
+
+        int64_t other_min = other.m_min.load(std::memory_order_relaxed);
+        cur = m_min.load(std::memory_order_relaxed);
+        while (other_min < cur && !m_min.compare_exchange_weak(cur, other_min, std::memory_order_relaxed)) {
+        }
+    }
+
+    /** not atomic with respect to concurrent records */
+    void    reset() {
+        for (int32_t i = 0; i < bucket_count; ++i) {
+            m_buckets[i].store(0, std::memory_order_relaxed);
+        }
+
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_min.store(INT64_MAX, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    static int32_t  bucket_index(int64_t value) {
+        uint64_t v = (uint64_t)value;
+        if (v >= ((uint64_t)1 << max_value_bits)) {
+            v = ((uint64_t)1 << max_value_bits) - 1;
+        }
+
+        if (v < 2 * sub_bucket_count) {
+            return (int32_t)v;
+        }
+
+        int32_t shift = highest_bit(v) - sub_bucket_bits;
+        return (int32_t)(2 * sub_bucket_count + (shift - 1) * sub_bucket_count + ((v >> shift) - sub_bucket_count));
+    }
+
+    /** the largest value that falls in the bucket */
+    static int64_t  bucket_upper_bound(int32_t index) {
+        if (index < 2 * sub_bucket_count) {
+            return index;
+        }
+
+        int32_t shift = (index - 2 * sub_bucket_count) / sub_bucket_count + 1;
+        int64_t mantissa = (index - 2 * sub_bucket_count) % sub_bucket_count + sub_bucket_count;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+protected:
+    static int32_t  highest_bit(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(v);
+#else
+        int32_t bit = 0;
+        while (v >>= 1) {
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+
+    static int64_t  value_at(const uint64_t* counts, uint64_t total, double quantile, int64_t max_value) {
+        uint64_t rank = (uint64_t)(quantile * total);
+        if (rank >= total) {
+            rank = total - 1;
+        }
+
+        uint64_t seen = 0;
+        for (int32_t i = 0; i < bucket_count; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return (std::min)(bucket_upper_bound(i), max_value);
+            }
+        }
+
+        return max_value;
+    }
+};
+
+/** latency histogram of the messages led by one broker */
+struct kafka_broker_latency
+{
+    int32_t                 broker_id;
+    kafka_latency_histogram histogram;
+
+    kafka_broker_latency(int32_t id) : broker_id(id) {
+    }
+};
+
+}
+
+#endif
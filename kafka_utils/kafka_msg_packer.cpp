@@ -0,0 +1,235 @@
+﻿#include "kafka_msg_packer.h"
+#include "kafka_envelope.hpp"
+#include "kafka_thread_pool.hpp"
+#include <chrono>
+
+namespace utility
+{
+
+static int64_t steady_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint32_t buffer_hash(const std::string& buffer_key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < buffer_key.size(); ++i) {
+        hash ^= (uint8_t)buffer_key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+kafka_msg_packer::kafka_msg_packer(kafka_producer* producer, const kafka_msg_packer_options& options)
+    : m_producer(producer)
+    , m_options(options)
+    , m_flush_thread_pool(nullptr){
+    m_flush_thread_pool = new kafka_thread_pool(std::bind(&kafka_msg_packer::flush_tick_func, this), 1);
+}
+
+kafka_msg_packer::~kafka_msg_packer() {
+    if (m_flush_thread_pool) {
+        delete m_flush_thread_pool;
+        m_flush_thread_pool = nullptr;
+    }
+
+    flush(nullptr);
+
+    for (auto& stripe : m_stripes) {
+        for (auto& buffer : stripe.buffers) {
+            delete buffer.second;
+        }
+        stripe.buffers.clear();
+    }
+}
+
+bool    kafka_msg_packer::pack_msg(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, std::string* err_string) {
+    return pack_msg(topic_name, partition, msg.data(), (int32_t)msg.size(), key, err_string);
+}
+
+bool    kafka_msg_packer::pack_msg(const std::string& topic_name, int32_t partition, const char* msg, int32_t msg_len, const std::string* key, std::string* err_string) {
+    if (msg_len < 0 || (!msg && msg_len > 0)) {
+        if (err_string) {
+            *err_string = "invalid msg_len " + std::to_string(msg_len);
+        }
+        return false;
+    }
+
+    // topic \0 partition \0 key, a keyless record is told from an empty key by the marker
+    std::string buffer_key;
+    buffer_key.reserve(topic_name.size() + 16 + (key ? key->size() : 0));
+    buffer_key.append(topic_name);
+    buffer_key.push_back('\0');
+    buffer_key.append(std::to_string(partition));
+    buffer_key.push_back(key ? '\1' : '\0');
+    if (key) {
+        buffer_key.append(*key);
+    }
+
+    pack_stripe& stripe = m_stripes[buffer_hash(buffer_key) % stripe_count];
+    std::unique_lock<std::mutex> locker(stripe.mtx);
+
+    pack_buffer*& slot = stripe.buffers[buffer_key];
+    if (!slot) {
+        slot = new pack_buffer();
+        slot->topic_name = topic_name;
+        slot->partition = partition;
+        slot->has_key = key != nullptr;
+        slot->key = key ? *key : std::string();
+    }
+    pack_buffer* buffer = slot;
+
+    // a full envelope is produced before the record goes in, a record bigger than an envelope goes alone
+    size_t record_size = kafka_envelope::record_size((uint32_t)msg_len);
+    if (buffer->record_count > 0 && 
+        (buffer->envelope.size() + record_size > (size_t)m_options.max_envelope_bytes || 
+         buffer->record_count >= m_options.max_envelope_records)) {
+        seal_envelope(buffer);
+    }
+
+    // the envelopes that failed before hold the new records back
+    if (!buffer->sealed.empty() && !produce_sealed(locker, buffer, err_string)) {
+        return false;
+    }
+
+    if (buffer->record_count == 0) {
+        kafka_envelope::begin(buffer->envelope);
+        buffer->first_record_time_ms = steady_now_ms();
+    }
+
+    kafka_envelope::append(buffer->envelope, msg, (uint32_t)msg_len);
+    ++buffer->record_count;
+
+    if (buffer->envelope.size() >= (size_t)m_options.max_envelope_bytes || 
+        buffer->record_count >= m_options.max_envelope_records) {
+        // the record is in, a failure here is retried by the flush thread
+        seal_envelope(buffer);
+        produce_sealed(locker, buffer, nullptr);
+    }
+
+    return true;
+}
+
+bool    kafka_msg_packer::flush(std::string* err_string) {
+    bool ret = true;
+    std::vector<pack_buffer*> buffers;
+
+    for (auto& stripe : m_stripes) {
+        std::unique_lock<std::mutex> locker(stripe.mtx);
+
+        for (auto& buffer : stripe.buffers) {
+            if (buffer.second->record_count > 0) {
+                seal_envelope(buffer.second);
+            }
+
+            if (!buffer.second->sealed.empty()) {
+                ++buffer.second->pins;
+                buffers.push_back(buffer.second);
+            }
+        }
+
+        for (auto buffer : buffers) {
+            if (!produce_sealed(locker, buffer, err_string)) {
+                ret = false;
+            }
+            --buffer->pins;
+        }
+        buffers.clear();
+    }
+
+    return ret;
+}
+
+void    kafka_msg_packer::start() {
+    m_flush_thread_pool->start();
+}
+
+void    kafka_msg_packer::stop() {
+    m_flush_thread_pool->stop();
+}
+
+void    kafka_msg_packer::wait_for_stop() {
+    m_flush_thread_pool->join_all();
+}
+
+void    kafka_msg_packer::seal_envelope(pack_buffer* buffer) {
+    buffer->sealed.push_back(std::string());
+    buffer->sealed.back().swap(buffer->envelope);
+    buffer->record_count = 0;
+}
+
+bool    kafka_msg_packer::produce_sealed(std::unique_lock<std::mutex>& locker, pack_buffer* buffer, std::string* err_string) {
+    if (buffer->producing) {
+        // keeps the envelopes in order, the other thread produces this one too
+        return true;
+    }
+
+    buffer->producing = true;
+    bool ret = true;
+
+    while (!buffer->sealed.empty()) {
+        std::string envelope;
+        envelope.swap(buffer->sealed.front());
+        buffer->sealed.pop_front();
+
+        // the produce may block on backpressure, the other buffers of the stripe go on meanwhile;
+        // topic_name, partition and key never change once the buffer is created
+        locker.unlock();
+        bool produced = m_producer->produce_envelope_move(buffer->topic_name, buffer->partition, std::move(envelope),
+            buffer->has_key ? &buffer->key : nullptr, err_string);
+        locker.lock();
+
+        if (!produced) {
+            // the envelope is moved back on failure
+            buffer->sealed.push_front(std::move(envelope));
+            ret = false;
+            break;
+        }
+    }
+
+    buffer->producing = false;
+    return ret;
+}
+
+bool    kafka_msg_packer::flush_tick_func() {
+    int64_t now_ms = steady_now_ms();
+    std::vector<pack_buffer*> buffers;
+
+    for (auto& stripe : m_stripes) {
+        std::unique_lock<std::mutex> locker(stripe.mtx);
+
+        for (auto iter = stripe.buffers.begin(); iter != stripe.buffers.end();) {
+            pack_buffer* buffer = iter->second;
+
+            if (buffer->record_count > 0 && now_ms - buffer->first_record_time_ms >= m_options.linger_ms) {
+                seal_envelope(buffer);
+            }
+
+            if (!buffer->sealed.empty()) {
+                buffers.push_back(buffer);
+            }
+
+            if (buffer->record_count == 0 && buffer->sealed.empty() && !buffer->producing && buffer->pins == 0 &&
+                now_ms - buffer->first_record_time_ms > 60 * 1000) {
+                // drop the buffers of the keys gone quiet
+                delete buffer;
+                iter = stripe.buffers.erase(iter);
+            }
+            else {
+                ++iter;
+            }
+        }
+
+        // produced after the walk, the map may change while the stripe is unlocked
+        for (auto buffer : buffers) {
+            produce_sealed(locker, buffer, nullptr);
+        }
+        buffers.clear();
+    }
+
+    // checked every 10ms, the thread pool sleeps when the tick returns false
+    return false;
+}
+
+} // end namespace utility
@@ -0,0 +1,115 @@
+﻿/**
+ * @brief kafka msg packer
+ *
+ * coalesces small records of the same topic/partition/key into one kafka message(see kafka_envelope),
+ * so that tiny records do not pay the per-message overhead of kafka and librdkafka;
+ * the consumer side unpacks them with kafka_consumer_options::unpack_envelopes
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-31
+ */
+
+#ifndef __utility_common_kafka_msg_packer_h__
+#define __utility_common_kafka_msg_packer_h__
+
+#include "kafka_common.h"
+#include "kafka_producer.h"
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <mutex>
+
+namespace utility {
+
+class kafka_thread_pool;
+
+struct kafka_msg_packer_options {
+    /** an envelope is produced when it would grow over max_envelope_bytes */
+    int32_t     max_envelope_bytes;
+    int32_t     max_envelope_records;
+    /** or when its first record has waited linger_ms, checked every 10ms */
+    int32_t     linger_ms;
+
+    kafka_msg_packer_options()
+        : max_envelope_bytes(16 * 1024)
+        , max_envelope_records(1000)
+        , linger_ms(5){
+    }
+};
+
+class kafka_msg_packer
+{
+protected:
+    /** the envelope being filled for one topic/partition/key */
+    struct pack_buffer {
+        std::string topic_name;
+        int32_t     partition;
+        bool        has_key;
+        std::string key;
+        std::string envelope;
+        int32_t     record_count;
+        int64_t     first_record_time_ms;
+        /** full envelopes waiting to be produced, oldest first */
+        std::deque<std::string> sealed;
+        /** a thread produces the sealed envelopes with the stripe unlocked, the buffer is not freed meanwhile */
+        bool        producing;
+        /** held by a flush across the unlocks of the stripe, the buffer is not freed meanwhile */
+        int32_t     pins;
+
+        pack_buffer() : partition(-1), has_key(false), record_count(0), first_record_time_ms(0), producing(false), pins(0) {
+        }
+    };
+
+    /** the buffers are striped so that producing threads rarely share a lock */
+    struct pack_stripe {
+        std::mutex                                      mtx;
+        std::unordered_map<std::string, pack_buffer*>   buffers;
+    };
+
+    enum {
+        stripe_count = 16,
+    };
+
+protected:
+    kafka_producer*             m_producer;
+    kafka_msg_packer_options    m_options;
+    pack_stripe                 m_stripes[stripe_count];
+    kafka_thread_pool*          m_flush_thread_pool;
+
+public:
+    /** producer is not owned, it must outlive the packer */
+    kafka_msg_packer(kafka_producer* producer, const kafka_msg_packer_options& options);
+    ~kafka_msg_packer();
+
+public:
+    /** 
+     * add a record to the envelope of its topic/partition/key, producing the envelope if it is full;
+     * false if the full envelope could not be produced, it is kept and retried by the flush thread,
+     * or if msg_len is negative
+     */
+    bool    pack_msg(const std::string& topic_name, int32_t partition, const char* msg, int32_t msg_len, const std::string* key, std::string* err_string);
+    bool    pack_msg(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, std::string* err_string);
+
+    /** produce all the pending envelopes now */
+    bool    flush(std::string* err_string);
+
+    /** the flush thread produces the envelopes that have lingered for linger_ms */
+    void    start();
+    void    stop();
+    void    wait_for_stop();
+
+protected:
+    /** move the envelope being filled to the sealed ones, the stripe is locked */
+    void    seal_envelope(pack_buffer* buffer);
+    /** 
+     * produce the sealed envelopes in order with the stripe unlocked, locker holds the stripe again on return;
+     * true if none is left, or another thread is producing them
+     */
+    bool    produce_sealed(std::unique_lock<std::mutex>& locker, pack_buffer* buffer, std::string* err_string);
+    bool    flush_tick_func();
+};
+
+} // end namespace utility
+
+#endif
@@ -0,0 +1,158 @@
+﻿/**
+ * @brief kafka offset tracker
+ *
+ * completed offsets of one partition whose messages are handled out of order,
+ * one bit per offset in a ring of 64 bit words; the commit position is the
+ * first offset still pending, so it only moves over a contiguous completed range
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-06-03
+ */
+
+#ifndef __utility_common_kafka_offset_tracker_hpp__
+#define __utility_common_kafka_offset_tracker_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+namespace utility
+{
+
+class kafka_offset_tracker
+{
+protected:
+    /** bit set while the offset is pending, offsets never tracked (compacted, control records) stay clear */
+    std::vector<std::atomic<uint64_t>>  m_words;
+    size_t                              m_word_mask;
+    /** first offset not known to be completed, -1 before the first track; written by the poll thread only */
+    std::atomic<int64_t>                m_base;
+    /** last tracked offset + 1; written by the poll thread only */
+    std::atomic<int64_t>                m_next_offset;
+
+public:
+    /** window is the max distance between the oldest pending and the newest tracked offset, rounded up to 64 * 2^n */
+    explicit kafka_offset_tracker(int32_t window)
+        : m_base(-1)
+        , m_next_offset(-1){
+        size_t word_count = 2;
+        while (word_count * 64 < (size_t)window) {
+            word_count <<= 1;
+        }
+
+        m_words = std::vector<std::atomic<uint64_t>>(word_count);
+        for (auto& word : m_words) {
+            word.store(0, std::memory_order_relaxed);
+        }
+        m_word_mask = word_count - 1;
+    }
+
+    kafka_offset_tracker(const kafka_offset_tracker&) = delete;
+    kafka_offset_tracker& operator=(const kafka_offset_tracker&) = delete;
+
+public:
+    /** 
+     * poll thread, marks the offset pending; offsets must increase, a rewind (seek) restarts the tracker once it is idle.
+     * false if the window is full or a rewind waits for the pending offsets, track again later
+     */
+    bool    track(int64_t offset) {
+        int64_t base = m_base.load(std::memory_order_relaxed);
+        int64_t next_offset = m_next_offset.load(std::memory_order_relaxed);
+
+        if (base >= 0 && offset >= next_offset && !in_window(base, offset)) {
+            base = committed_offset();
+        }
+
+        if (base < 0 || offset < next_offset || !in_window(base, offset)) {
+            if (base >= 0 && !idle()) {
+                return false;
+            }
+
+            // nothing pending, start over at the offset
+            m_next_offset.store(offset, std::memory_order_release);
+            m_base.store(offset, std::memory_order_release);
+        }
+
+        m_words[(size_t)(offset >> 6) & m_word_mask].fetch_or((uint64_t)1 << (offset & 63), std::memory_order_relaxed);
+        m_next_offset.store(offset + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** 
+     * any thread, after the message is handled; false if the offset is not pending:
+     * already completed, below the commit position or not tracked (yet), e.g. a stale ack from before a seek
+     */
+    bool    complete(int64_t offset) {
+        int64_t base = m_base.load(std::memory_order_acquire);
+        int64_t next_offset = m_next_offset.load(std::memory_order_acquire);
+
+        // the bit of an offset out of the window belongs to another offset of the ring
+        if (offset < base || offset >= next_offset || !in_window(offset, next_offset - 1)) {
+            return false;
+        }
+
+        uint64_t bit = (uint64_t)1 << (offset & 63);
+        return (m_words[(size_t)(offset >> 6) & m_word_mask].fetch_and(~bit, std::memory_order_release) & bit) != 0;
+    }
+
+    /** 
+     * poll thread, the offset to commit: every tracked offset below it is completed;
+     * -1 if nothing was tracked
+     */
+    int64_t committed_offset() {
+        int64_t base = m_base.load(std::memory_order_relaxed);
+        int64_t next_offset = m_next_offset.load(std::memory_order_relaxed);
+
+        while (base < next_offset) {
+            uint64_t word = m_words[(size_t)(base >> 6) & m_word_mask].load(std::memory_order_acquire);
+            word >>= (base & 63);
+
+            if (word != 0) {
+                base += count_trailing_zeros(word);
+                break;
+            }
+
+            // the rest of this word is completed or not tracked yet
+            base = (base | 63) + 1;
+            if (base > next_offset) {
+                base = next_offset;
+            }
+        }
+
+        m_base.store(base, std::memory_order_release);
+        return base;
+    }
+
+    /** poll thread, nothing pending */
+    bool    idle() {
+        return committed_offset() == m_next_offset.load(std::memory_order_relaxed);
+    }
+
+protected:
+    /** offset shares the ring with base without aliasing */
+    bool    in_window(int64_t base, int64_t offset) const {
+        return (uint64_t)(offset >> 6) - (uint64_t)(base >> 6) <= m_word_mask;
+    }
+
+    static inline int32_t count_trailing_zeros(uint64_t value) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(value);
+#else
+        int32_t count = 0;
+        while ((value & 0xff) == 0) {
+            value >>= 8;
+            count += 8;
+        }
+        while ((value & 1) == 0) {
+            value >>= 1;
+            ++count;
+        }
+        return count;
+#endif
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,390 @@
+﻿/**
+ * @brief kafka produce future
+ *
+ * per-message delivery state of the producer, kept in pooled slots
+ * and routed back from dr_cb through the msg_opaque
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-22
+ */
+
+#ifndef __utility_common_kafka_produce_future_hpp__
+#define __utility_common_kafka_produce_future_hpp__
+
+#include "kafka_common.h"
+#include <rdkafkacpp.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <new>
+
+namespace utility
+{
+
+struct kafka_delivery_result
+{
+    RdKafka::ErrorCode  err;
+    int32_t             partition;
+    int64_t             offset;
+
+    kafka_delivery_result() 
+        : err(RdKafka::ERR_NO_ERROR)
+        , partition(RdKafka::Topic::PARTITION_UA)
+        , offset(-1){
+    }
+};
+
+class kafka_delivery_slot_pool;
+class kafka_delivery_slot
+{
+public:
+    typedef std::function<void(char* payload, size_t len)> payload_deleter;
+    typedef std::function<void(const kafka_delivery_result& result)> delivery_callback;
+
+    friend class kafka_delivery_slot_pool;
+
+public:
+    /** payload owned by the slot, see kafka_producer::produce_msg_move */
+    std::string                 owned;
+    payload_deleter             deleter;
+    char*                       payload;
+    size_t                      len;
+    delivery_callback           callback;
+    /** passed back in kafka_delivery_record::opaque */
+    void*                       user_opaque;
+    /** the payload is a kafka_envelope, produced with its header and spilled with its mark */
+    bool                        envelope;
+
+protected:
+    kafka_delivery_slot_pool*   m_pool;
+    /** position in the pool, and the next free slot while the slot is in the free list */
+    uint32_t                    m_index;
+    std::atomic<uint32_t>       m_next_free;
+    /** one for librdkafka, one more while a future is attached */
+    std::atomic<int32_t>        m_refs;
+    std::mutex                  m_mtx;
+    std::condition_variable     m_cv;
+    bool                        m_done;
+    kafka_delivery_result       m_result;
+
+public:
+    kafka_delivery_slot(kafka_delivery_slot_pool* pool = nullptr) 
+        : payload(nullptr)
+        , len(0)
+        , user_opaque(nullptr)
+        , envelope(false)
+        , m_pool(pool)
+        , m_index(0)
+        , m_next_free(0)
+        , m_refs(0)
+        , m_done(false){
+    }
+
+public:
+    void    add_ref() {
+        m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /** give the slot back to the pool when the last reference is released */
+    inline void release();
+
+    /** called from dr_cb, or directly if the message was never enqueued */
+    void    complete(RdKafka::ErrorCode err, int32_t partition, int64_t offset) {
+        kafka_delivery_result result;
+        result.err = err;
+        result.partition = partition;
+        result.offset = offset;
+
+        if (callback) {
+            callback(result);
+        }
+
+        if (deleter) {
+            deleter(payload, len);
+        }
+
+        {
+            std::lock_guard<std::mutex> locker(m_mtx);
+            m_result = result;
+            m_done = true;
+        }
+        m_cv.notify_all();
+    }
+
+    /** someone waits for the delivery result: a callback, a future or a batch delivery record */
+    bool    observed() const {
+        return callback || user_opaque || m_refs.load(std::memory_order_relaxed) > 1;
+    }
+
+    bool    ready() {
+        std::lock_guard<std::mutex> locker(m_mtx);
+        return m_done;
+    }
+
+    bool    wait(int32_t timeout_ms) {
+        std::unique_lock<std::mutex> locker(m_mtx);
+        if (timeout_ms < 0) {
+            m_cv.wait(locker, [this] { return m_done; });
+            return true;
+        }
+
+        return m_cv.wait_for(locker, std::chrono::milliseconds(timeout_ms), [this] { return m_done; });
+    }
+
+    kafka_delivery_result result() {
+        std::lock_guard<std::mutex> locker(m_mtx);
+        return m_result;
+    }
+
+protected:
+    void    reset() {
+        // drop the buffer itself, not only its content
+        std::string().swap(owned);
+        deleter = nullptr;
+        payload = nullptr;
+        len = 0;
+        callback = nullptr;
+        user_opaque = nullptr;
+        envelope = false;
+        m_done = false;
+        m_result = kafka_delivery_result();
+    }
+};
+
+/** 
+ * lock-free free list of slots, acquire and recycle run on every produce and delivery report;
+ * the slots live in chunks of doubling size and are only freed with the pool, so a slot index stays valid
+ */
+class kafka_delivery_slot_pool
+{
+protected:
+    enum {
+        first_chunk_size = 64,
+        max_chunk_count = 25,
+        null_index = 0xffffffff,
+    };
+
+    /** chunk k holds first_chunk_size << k slots, starting at index first_chunk_size * (2^k - 1) */
+    std::atomic<kafka_delivery_slot*>   m_chunks[max_chunk_count];
+    std::atomic<int32_t>                m_chunk_count;
+    /** index of the first free slot in the low 32 bits, a counter against ABA in the high 32 bits */
+    std::atomic<uint64_t>               m_free_head;
+    std::atomic<int32_t>                m_in_use_count;
+    /** taken only to add a chunk */
+    std::mutex                          m_grow_mtx;
+
+public:
+    kafka_delivery_slot_pool() 
+        : m_chunk_count(0)
+        , m_free_head(null_index)
+        , m_in_use_count(0){
+        for (int32_t i = 0; i < max_chunk_count; ++i) {
+            m_chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~kafka_delivery_slot_pool() {
+        for (int32_t i = 0; i < m_chunk_count.load(); ++i) {
+            delete[] m_chunks[i].load();
+        }
+    }
+
+    kafka_delivery_slot_pool(const kafka_delivery_slot_pool&) = delete;
+    kafka_delivery_slot_pool& operator=(const kafka_delivery_slot_pool&) = delete;
+
+public:
+    /** a recycled slot holding one reference */
+    kafka_delivery_slot*    acquire() {
+        kafka_delivery_slot* slot = pop_free();
+        if (!slot) {
+            slot = grow();
+        }
+
+        m_in_use_count.fetch_add(1, std::memory_order_relaxed);
+        slot->m_refs.store(1, std::memory_order_relaxed);
+        return slot;
+    }
+
+    void    recycle(kafka_delivery_slot* slot) {
+        slot->reset();
+
+        m_in_use_count.fetch_sub(1, std::memory_order_relaxed);
+        push_free(slot, slot);
+    }
+
+    /** 
+     * completes the slots still waiting for their delivery report with err and drops the reference of librdkafka;
+     * only once the librdkafka producer is destroyed, no report comes for them any more
+     */
+    void    fail_pending(RdKafka::ErrorCode err) {
+        int32_t chunk_count = m_chunk_count.load(std::memory_order_acquire);
+        for (int32_t chunk_index = 0; chunk_index < chunk_count; ++chunk_index) {
+            kafka_delivery_slot* chunk = m_chunks[chunk_index].load(std::memory_order_acquire);
+            uint32_t size = (uint32_t)first_chunk_size << chunk_index;
+            for (uint32_t i = 0; i < size; ++i) {
+                if (chunk[i].m_refs.load(std::memory_order_acquire) > 0 && !chunk[i].ready()) {
+                    chunk[i].complete(err, -1, -1);
+                    chunk[i].release();
+                }
+            }
+        }
+    }
+
+    /** count of slots in use */
+    int32_t in_use_count() {
+        return m_in_use_count.load(std::memory_order_relaxed);
+    }
+
+protected:
+    kafka_delivery_slot*    slot_at(uint32_t index) const {
+        uint32_t n = index / first_chunk_size + 1;
+        int32_t chunk = 0;
+        while (n >>= 1) {
+            ++chunk;
+        }
+
+        uint32_t start = first_chunk_size * ((1u << chunk) - 1);
+        return m_chunks[chunk].load(std::memory_order_acquire) + (index - start);
+    }
+
+    kafka_delivery_slot*    pop_free() {
+        uint64_t head = m_free_head.load(std::memory_order_acquire);
+        while ((uint32_t)head != null_index) {
+            // the slot may be taken and pushed back meanwhile, the counter makes the exchange fail then
+            uint64_t next = (((head >> 32) + 1) << 32) | slot_at((uint32_t)head)->m_next_free.load(std::memory_order_relaxed);
+            if (m_free_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return slot_at((uint32_t)head);
+            }
+        }
+
+        return nullptr;
+    }
+
+    /** first to last are linked by m_next_free already */
+    void    push_free(kafka_delivery_slot* first, kafka_delivery_slot* last) {
+        uint64_t head = m_free_head.load(std::memory_order_relaxed);
+        do {
+            last->m_next_free.store((uint32_t)head, std::memory_order_relaxed);
+        } while (!m_free_head.compare_exchange_weak(head, (((head >> 32) + 1) << 32) | first->m_index,
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    kafka_delivery_slot*    grow() {
+        std::lock_guard<std::mutex> locker(m_grow_mtx);
+
+        // another thread may have added a chunk meanwhile
+        kafka_delivery_slot* slot = pop_free();
+        if (slot) {
+            return slot;
+        }
+
+        int32_t chunk_index = m_chunk_count.load(std::memory_order_relaxed);
+        if (chunk_index == max_chunk_count) {
+            throw std::bad_alloc();
+        }
+
+        uint32_t size = (uint32_t)first_chunk_size << chunk_index;
+        uint32_t start = first_chunk_size * ((1u << chunk_index) - 1);
+
+        kafka_delivery_slot* chunk = new kafka_delivery_slot[size];
+        for (uint32_t i = 0; i < size; ++i) {
+            chunk[i].m_pool = this;
+            chunk[i].m_index = start + i;
+            chunk[i].m_next_free.store(start + i + 1, std::memory_order_relaxed);
+        }
+
+        m_chunks[chunk_index].store(chunk, std::memory_order_release);
+        m_chunk_count.store(chunk_index + 1, std::memory_order_release);
+
+        // the first slot is taken, the rest goes to the free list at once
+        push_free(&chunk[1], &chunk[size - 1]);
+        return &chunk[0];
+    }
+};
+
+inline void kafka_delivery_slot::release() {
+    if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_pool->recycle(this);
+    }
+}
+
+/** 
+ * the result of kafka_producer::produce_msg_async, 
+ * it must not outlive the producer which returned it
+ */
+class kafka_produce_future
+{
+protected:
+    kafka_delivery_slot*    m_slot;
+
+public:
+    kafka_produce_future() : m_slot(nullptr) {
+    }
+
+    /** takes one reference of the slot */
+    explicit kafka_produce_future(kafka_delivery_slot* slot) : m_slot(slot) {
+    }
+
+    kafka_produce_future(kafka_produce_future&& other) : m_slot(other.m_slot) {
+        other.m_slot = nullptr;
+    }
+
+    kafka_produce_future& operator=(kafka_produce_future&& other) {
+        if (this != &other) {
+            reset();
+            m_slot = other.m_slot;
+            other.m_slot = nullptr;
+        }
+
+        return *this;
+    }
+
+    ~kafka_produce_future() {
+        reset();
+    }
+
+    kafka_produce_future(const kafka_produce_future&) = delete;
+    kafka_produce_future& operator=(const kafka_produce_future&) = delete;
+
+public:
+    bool    valid() const {
+        return m_slot != nullptr;
+    }
+
+    /** true if the delivery report has arrived */
+    bool    ready() {
+        return m_slot && m_slot->ready();
+    }
+
+    /** wait for the delivery report, timeout_ms < 0 means wait forever; returns false on timeout */
+    bool    wait(int32_t timeout_ms = -1) {
+        return m_slot && m_slot->wait(timeout_ms);
+    }
+
+    /** wait for the delivery report and return it */
+    kafka_delivery_result get() {
+        if (!m_slot) {
+            kafka_delivery_result result;
+            result.err = RdKafka::ERR__STATE;
+            return result;
+        }
+
+        m_slot->wait(-1);
+        return m_slot->result();
+    }
+
+    void    reset() {
+        if (m_slot) {
+            m_slot->release();
+            m_slot = nullptr;
+        }
+    }
+};
+
+} // end namespace utility
+
+#endif
@@ -2,20 +2,92 @@
 #include "kafka_producer_event_handler.h"
 #include "kafka_thread_pool.hpp"
 #include "kafka_ip_utils.hpp"
+#include "kafka_topic_cache.hpp"
+#include "kafka_default_define.hpp"
+#include "kafka_spill_log.h"
+#include "kafka_envelope.hpp"
+#include <rdkafka.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
 
 namespace utility
 {
 
+static int64_t steady_now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** delivery reports of the current poll cycle of a work thread */
+struct delivery_report_batch {
+    kafka_producer*                     owner;
+    std::vector<kafka_delivery_record>  records;
+    int64_t                             success_count;
+
+    delivery_report_batch() : owner(nullptr), success_count(0) {
+    }
+};
+
+static thread_local delivery_report_batch* current_delivery_batch = nullptr;
+
+static bool is_unknown_topic_error(RdKafka::ErrorCode err) {
+    return err == RdKafka::ERR__UNKNOWN_TOPIC 
+        || err == RdKafka::ERR__UNKNOWN_PARTITION 
+        || err == RdKafka::ERR_UNKNOWN_TOPIC_OR_PART;
+}
+
+/** failures that may succeed later, the message is worth spilling */
+static bool is_spillable_error(RdKafka::ErrorCode err) {
+    switch (err)
+    {
+    case RdKafka::ERR__MSG_TIMED_OUT:
+    case RdKafka::ERR__TIMED_OUT:
+    case RdKafka::ERR__TRANSPORT:
+    case RdKafka::ERR__ALL_BROKERS_DOWN:
+    case RdKafka::ERR__QUEUE_FULL:
+    case RdKafka::ERR_REQUEST_TIMED_OUT:
+    case RdKafka::ERR_NETWORK_EXCEPTION:
+    case RdKafka::ERR_LEADER_NOT_AVAILABLE:
+    case RdKafka::ERR_NOT_LEADER_FOR_PARTITION:
+    case RdKafka::ERR_NOT_ENOUGH_REPLICAS:
+    case RdKafka::ERR_NOT_ENOUGH_REPLICAS_AFTER_APPEND:
+    // purged by shutdown, an in-flight one may have been delivered already
+    case RdKafka::ERR__PURGE_QUEUE:
+    case RdKafka::ERR__PURGE_INFLIGHT:
+        return true;
+    default:
+        return false;
+    }
+}
+
 std::string kafka_producer::error_to_string(int32_t error_code){
     return RdKafka::err2str((RdKafka::ErrorCode)error_code);
 }
 
 kafka_producer::kafka_producer(const kafka_producer_options& options, int32_t work_thread_count)
-    : m_event_handler(nullptr)
+    : m_metadata_thread_pool(nullptr)
+    , m_event_handler(nullptr)
     , m_options(options)
     , m_global_conf(nullptr)
     , m_default_topic_conf(nullptr)
-    , m_producer(nullptr){
+    , m_producer(nullptr)
+    , m_topic_cache(nullptr)
+    , m_slot_pool(nullptr)
+    , m_stats_observer(nullptr)
+    , m_delivered_seq(0)
+    , m_blocked_count(0)
+    , m_total_blocked_count(0)
+    , m_total_blocked_time_us(0)
+    , m_spill_log(nullptr)
+    , m_spill_thread_pool(nullptr)
+    , m_brokers_down(false)
+    , m_spill_next_probe_ms(0)
+    , m_spill_last_replay_ms(0)
+    , m_spill_replay_credit(0)
+    , m_rate_limiters_shared(false)
+    , m_shutting_down(false)
+    , m_metadata_wakeup(false){
     m_global_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
     m_default_topic_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_TOPIC);
 
@@ -27,6 +99,16 @@ kafka_producer::kafka_producer(const kafka_producer_options& options, int32_t wo
         m_default_topic_conf->set("partitioner_cb", m_options.partitioner_cb, err_string);
     }
 
+    // e.g. load_aware_partitioner
+    m_stats_observer = dynamic_cast<kafka_stats_observer*>(m_options.partitioner_cb);
+    if (m_stats_observer && m_options.statistics_interval_ms <= 0) {
+        m_options.statistics_interval_ms = 1000;
+    }
+
+    if (m_options.statistics_interval_ms > 0) {
+        m_global_conf->set("statistics.interval.ms", std::to_string(m_options.statistics_interval_ms), err_string);
+    }
+
     m_global_conf->set("metadata.broker.list", m_options.broker_list, err_string);
 
     if (m_options.use_sasl) {
@@ -45,11 +127,65 @@ kafka_producer::kafka_producer(const kafka_producer_options& options, int32_t wo
     m_global_conf->set("event_cb", (RdKafka::EventCb*)this, err_string);
 
     m_producer = RdKafka::Producer::create(m_global_conf, err_string);
+    m_topic_cache = new kafka_topic_cache();
+    m_slot_pool = new kafka_delivery_slot_pool();
 
     m_work_thread_pool = new kafka_thread_pool(std::bind(&kafka_producer::tick_func, this), work_thread_count);
+    if (m_options.metadata_ttl_ms > 0) {
+        m_metadata_thread_pool = new kafka_thread_pool(std::bind(&kafka_producer::metadata_tick_func, this), 1);
+    }
+
+    for (auto& limit : m_options.topic_rate_limit) {
+        m_rate_limiters[limit.first] = new kafka_topic_rate_limiter(limit.second);
+    }
+
+    if (!m_options.spill_dir.empty()) {
+        m_spill_log = new kafka_spill_log(m_options.spill_dir, m_options.spill_segment_size, m_options.spill_max_bytes);
+        if (m_spill_log->open(&err_string)) {
+            m_spill_thread_pool = new kafka_thread_pool(std::bind(&kafka_producer::spill_tick_func, this), 1);
+        }
+        else {
+            delete m_spill_log;
+            m_spill_log = nullptr;
+        }
+    }
 }
 
 kafka_producer::~kafka_producer() {
+    // nothing is flushed, but the queued messages are reported or spilled instead of dropped silently
+    if (!m_shutting_down.load()) {
+        shutdown(0, nullptr);
+    }
+
+    // the reports of the purged messages come asynchronously, serve them for a short while
+    if (m_producer) {
+        int64_t deadline_ms = steady_now_ms() + 1000;
+        while (m_producer->outq_len() > 0 && steady_now_ms() < deadline_ms) {
+            m_producer->poll(10);
+        }
+    }
+
+    if (m_work_thread_pool) {
+        delete m_work_thread_pool;
+        m_work_thread_pool = nullptr;
+    }
+
+    if (m_metadata_thread_pool) {
+        delete m_metadata_thread_pool;
+        m_metadata_thread_pool = nullptr;
+    }
+
+    if (m_spill_thread_pool) {
+        delete m_spill_thread_pool;
+        m_spill_thread_pool = nullptr;
+    }
+
+    // topic handles must be destroyed before the producer
+    if (m_topic_cache) {
+        delete m_topic_cache;
+        m_topic_cache = nullptr;
+    }
+
     if (m_producer) {
         delete m_producer;
         m_producer = nullptr;
@@ -64,6 +200,26 @@ kafka_producer::~kafka_producer() {
         delete m_default_topic_conf;
         m_default_topic_conf = nullptr;
     }
+
+    // the producer is gone, the reports that did not come never will: the futures, callbacks and deleters are failed here
+    if (m_slot_pool) {
+        m_slot_pool->fail_pending(RdKafka::ERR__DESTROY);
+        delete m_slot_pool;
+        m_slot_pool = nullptr;
+    }
+
+    if (!m_rate_limiters_shared) {
+        for (auto& limiter : m_rate_limiters) {
+            delete limiter.second;
+        }
+    }
+    m_rate_limiters.clear();
+
+    // after the producer, its last delivery reports may still spill
+    if (m_spill_log) {
+        delete m_spill_log;
+        m_spill_log = nullptr;
+    }
 }
 
 void    kafka_producer::set_event_handler(kafka_producer_event_handler* handler) {
@@ -75,38 +231,496 @@ bool kafka_producer::produce_msg(const std::string& topic_name, const std::strin
 }
 
 bool kafka_producer::produce_msg(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, std::string* err_string) {
-    if (!m_producer) {
+    return produce_impl(topic_name, partition, RdKafka::Producer::RK_MSG_COPY /* Copy payload */,
+        const_cast<char *>(msg.c_str()), msg.size(), key, nullptr, err_string) == RdKafka::ERR_NO_ERROR;
+}
+
+bool kafka_producer::produce_msg_move(const std::string& topic_name, std::string&& msg, const std::string* key, std::string* err_string) {
+    return produce_msg_move(topic_name, RdKafka::Topic::PARTITION_UA, std::move(msg), key, err_string);
+}
+
+bool kafka_producer::produce_msg_move(const std::string& topic_name, int32_t partition, std::string&& msg, const std::string* key, std::string* err_string) {
+    return produce_owned(topic_name, partition, std::move(msg), key, false, err_string);
+}
+
+bool kafka_producer::produce_envelope_move(const std::string& topic_name, int32_t partition, std::string&& envelope, const std::string* key, std::string* err_string) {
+    return produce_owned(topic_name, partition, std::move(envelope), key, true, err_string);
+}
+
+bool kafka_producer::produce_owned(const std::string& topic_name, int32_t partition, std::string&& msg, const std::string* key, bool envelope, std::string* err_string) {
+    kafka_delivery_slot* slot = m_slot_pool->acquire();
+    slot->envelope = envelope;
+    slot->owned = std::move(msg);
+    slot->payload = const_cast<char *>(slot->owned.data());
+    slot->len = slot->owned.size();
+
+    if (produce_impl(topic_name, partition, 0, slot->payload, slot->len, key, slot, err_string) != RdKafka::ERR_NO_ERROR) {
+        // give the buffer back to the caller
+        msg = std::move(slot->owned);
+        slot->release();
         return false;
     }
 
-    auto res = m_producer->produce(topic_name, partition,
-        RdKafka::Producer::RK_MSG_COPY /* Copy payload */,
+    return true;
+}
+
+bool kafka_producer::produce_msg(const std::string& topic_name, int32_t partition, const char* payload, size_t len, payload_policy policy, const std::string* key, std::string* err_string) {
+    return produce_impl(topic_name, partition, msg_flags_of(policy), 
+        const_cast<char *>(payload), len, key, nullptr, err_string) == RdKafka::ERR_NO_ERROR;
+}
+
+bool kafka_producer::produce_msg(const std::string& topic_name, int32_t partition, char* payload, size_t len, const payload_deleter& deleter, const std::string* key, std::string* err_string) {
+    if (!deleter) {
+        return produce_msg(topic_name, partition, payload, len, payload_free, key, err_string);
+    }
+
+    kafka_delivery_slot* slot = m_slot_pool->acquire();
+    slot->deleter = deleter;
+    slot->payload = payload;
+    slot->len = len;
+
+    if (produce_impl(topic_name, partition, 0, payload, len, key, slot, err_string) != RdKafka::ERR_NO_ERROR) {
+        slot->deleter = nullptr;
+        slot->release();
+        return false;
+    }
+
+    return true;
+}
+
+kafka_produce_future kafka_producer::produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key) {
+    kafka_delivery_slot* slot = m_slot_pool->acquire();
+    slot->add_ref();
+
+    auto res = produce_impl(topic_name, partition, RdKafka::Producer::RK_MSG_COPY,
+        const_cast<char *>(msg.c_str()), msg.size(), key, slot, nullptr);
+
+    if (res != RdKafka::ERR_NO_ERROR) {
+        slot->complete(res, partition, -1);
+        slot->release();
+    }
+
+    return kafka_produce_future(slot);
+}
+
+bool kafka_producer::produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key,
+    const delivery_callback& callback, std::string* err_string) {
+    kafka_delivery_slot* slot = m_slot_pool->acquire();
+    slot->callback = callback;
+
+    if (produce_impl(topic_name, partition, RdKafka::Producer::RK_MSG_COPY,
+        const_cast<char *>(msg.c_str()), msg.size(), key, slot, err_string) != RdKafka::ERR_NO_ERROR) {
+        slot->callback = nullptr;
+        slot->release();
+        return false;
+    }
+
+    return true;
+}
+
+int32_t kafka_producer::produce_batch(const std::string& topic_name, int32_t partition, std::vector<kafka_produce_record>& records, payload_policy policy) {
+    if (!m_producer || records.empty()) {
+        return 0;
+    }
+
+    if (m_shutting_down.load(std::memory_order_relaxed)) {
+        for (auto& record : records) {
+            record.err = RdKafka::ERR__STATE;
+        }
+
+        return 0;
+    }
+
+    kafka_topic_entry* topic = get_topic(topic_name, nullptr);
+    if (!topic) {
+        for (auto& record : records) {
+            record.err = RdKafka::ERR__INVALID_ARG;
+        }
+
+        return 0;
+    }
+
+    int32_t msg_flags = msg_flags_of(policy);
+    // the records with an opaque are awaited by the batch delivery report, they are never spilled
+    bool spillable = is_spillable(msg_flags, nullptr);
+
+    int64_t total_bytes = 0;
+    for (auto& record : records) {
+        total_bytes += (int64_t)record.len;
+    }
+
+    kafka_topic_rate_limiter* limiter = topic->rate_limiter;
+    if (limiter && !limiter->acquire((int64_t)records.size(), total_bytes)) {
+        int32_t spilled_count = 0;
+        for (auto& record : records) {
+            record.err = RdKafka::ERR__QUEUE_FULL;
+
+            if (limiter->limit().policy == rate_limit_spill && spillable && !record.opaque &&
+                spill(topic_name, partition, msg_flags, const_cast<char *>(record.payload), record.len,
+                    record.key ? record.key->data() : nullptr, record.key ? record.key->size() : 0, nullptr)) {
+                limiter->on_spilled();
+                record.err = RdKafka::ERR_NO_ERROR;
+                ++spilled_count;
+            }
+        }
+
+        limiter->on_rejected((int64_t)records.size() - spilled_count);
+        return spilled_count;
+    }
+
+    // do not pile the messages up in memory while no broker is reachable
+    bool brokers_down = spillable && m_brokers_down.load(std::memory_order_relaxed);
+
+    std::vector<rd_kafka_message_t> rk_messages;
+    std::vector<size_t> record_indexes;
+    rk_messages.reserve(records.size());
+    record_indexes.reserve(records.size());
+
+    for (size_t i = 0; i < records.size(); ++i) {
+        auto& record = records[i];
+        record.err = RdKafka::ERR_NO_ERROR;
+
+        if (brokers_down && !record.opaque &&
+            spill(topic_name, partition, msg_flags, const_cast<char *>(record.payload), record.len,
+                record.key ? record.key->data() : nullptr, record.key ? record.key->size() : 0, nullptr)) {
+            continue;
+        }
+
+        rk_messages.push_back(rd_kafka_message_t());
+        record_indexes.push_back(i);
+
+        auto& rk_message = rk_messages.back();
+        memset(&rk_message, 0, sizeof(rk_message));
+        rk_message.payload = const_cast<char *>(record.payload);
+        rk_message.len = record.len;
+        rk_message.key = record.key ? const_cast<char *>(record.key->c_str()) : NULL;
+        rk_message.key_len = record.key ? record.key->size() : 0;
+
+        if (record.opaque) {
+            kafka_delivery_slot* slot = m_slot_pool->acquire();
+            slot->user_opaque = record.opaque;
+            rk_message._private = slot;
+        }
+    }
+
+    if (!rk_messages.empty()) {
+        rd_kafka_produce_batch(topic->topic->c_ptr(), partition, msg_flags, &rk_messages[0], (int32_t)rk_messages.size());
+    }
+
+    int32_t enqueued_count = 0;
+    int64_t failed_bytes = 0;
+    int32_t failed_count = 0;
+
+    for (size_t i = 0; i < rk_messages.size(); ++i) {
+        auto& record = records[record_indexes[i]];
+        auto& rk_message = rk_messages[i];
+        kafka_delivery_slot* slot = static_cast<kafka_delivery_slot*>(rk_message._private);
+
+        record.err = (RdKafka::ErrorCode)rk_message.err;
+
+        // the queue filled up within the batch, the rest wait or spill one by one as produce_msg does
+        if (record.err == RdKafka::ERR__QUEUE_FULL) {
+            record.err = produce_or_spill(topic, partition, msg_flags, const_cast<char *>(record.payload), record.len,
+                record.key, slot, spillable && !slot);
+        }
+
+        if (record.err != RdKafka::ERR_NO_ERROR) {
+            if (slot) {
+                slot->release();
+            }
+
+            if (is_unknown_topic_error(record.err) && topic->metadata_expire_time_ms.exchange(0) != 0) {
+                wakeup_metadata_thread();
+            }
+
+            failed_bytes += (int64_t)record.len;
+            ++failed_count;
+        }
+    }
+
+    for (auto& record : records) {
+        if (record.err == RdKafka::ERR_NO_ERROR) {
+            ++enqueued_count;
+        }
+    }
+
+    if (failed_count > 0 && limiter) {
+        limiter->refund(failed_count, failed_bytes);
+    }
+
+    return enqueued_count;
+}
+
+int32_t kafka_producer::msg_flags_of(payload_policy policy) {
+    switch (policy)
+    {
+    case payload_copy:
+        return RdKafka::Producer::RK_MSG_COPY;
+    case payload_free:
+        return RdKafka::Producer::RK_MSG_FREE;
+    default:
+        return 0;
+    }
+}
+
+kafka_topic_entry* kafka_producer::get_topic(const std::string& topic_name, std::string* err_string) {
+    kafka_topic_entry* topic = m_topic_cache->find(topic_name);
+    if (topic) {
+        return topic;
+    }
+
+    return m_topic_cache->get(topic_name, [&](const std::string& name) {
+        return create_topic(name, err_string);
+    }, [this](kafka_topic_entry* entry) {
+        auto iter = m_rate_limiters.find(entry->name);
+        if (iter != m_rate_limiters.end()) {
+            entry->rate_limiter = iter->second;
+        }
+
+        // first metadata fetch of the new topic
+        wakeup_metadata_thread();
+    });
+}
+
+RdKafka::Topic* kafka_producer::create_topic(const std::string& topic_name, std::string* err_string) {
+    std::string err_string_inner;
+    RdKafka::Topic* topic = nullptr;
+
+    auto iter = m_options.topic_conf.find(topic_name);
+    if (iter == m_options.topic_conf.end()) {
+        topic = RdKafka::Topic::create(m_producer, topic_name, m_default_topic_conf, err_string_inner);
+    }
+    else {
+        RdKafka::Conf* topic_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_TOPIC);
+
+        if (m_options.partitioner_cb) {
+            topic_conf->set("partitioner_cb", m_options.partitioner_cb, err_string_inner);
+        }
+
+        for (auto& conf : iter->second) {
+            if (topic_conf->set(conf.first, conf.second, err_string_inner) != RdKafka::Conf::CONF_OK) {
+                break;
+            }
+        }
+
+        if (err_string_inner.empty()) {
+            topic = RdKafka::Topic::create(m_producer, topic_name, topic_conf, err_string_inner);
+        }
+
+        delete topic_conf;
+    }
+
+    if (!topic && err_string) {
+        *err_string = err_string_inner;
+    }
+
+    return topic;
+}
+
+bool kafka_producer::wait_for_queue_space(uint64_t seen_delivered_seq, const std::chrono::steady_clock::time_point* deadline) {
+    // wait in slices, serving the delivery reports here too in case no work thread is polling
+    const std::chrono::milliseconds slice(100);
+    auto has_delivered = [&] { return m_delivered_seq.load() != seen_delivered_seq; };
+
+    while (true) {
+        if (m_shutting_down.load()) {
+            return false;
+        }
+
+        auto wake_time = std::chrono::steady_clock::now() + slice;
+        if (deadline && *deadline < wake_time) {
+            wake_time = *deadline;
+        }
+
+        {
+            std::unique_lock<std::mutex> locker(m_backpressure_mtx);
+            if (m_backpressure_cv.wait_until(locker, wake_time, has_delivered)) {
+                return true;
+            }
+        }
+
+        if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+            return false;
+        }
+
+        m_producer->poll(0);
+        if (has_delivered()) {
+            return true;
+        }
+    }
+}
+
+RdKafka::ErrorCode kafka_producer::produce_impl(const std::string& topic_name, int32_t partition, int32_t msg_flags,
+    char* payload, size_t len, const std::string* key, kafka_delivery_slot* slot, std::string* err_string) {
+    if (!m_producer) {
+        return RdKafka::ERR__STATE;
+    }
+
+    if (m_shutting_down.load(std::memory_order_relaxed)) {
+        if (err_string) {
+            *err_string = "producer is shut down";
+        }
+        return RdKafka::ERR__STATE;
+    }
+
+    kafka_topic_entry* topic = get_topic(topic_name, err_string);
+    if (!topic) {
+        return RdKafka::ERR__INVALID_ARG;
+    }
+
+    bool spillable = is_spillable(msg_flags, slot);
+    const char* key_data = key ? key->data() : nullptr;
+    size_t key_len = key ? key->size() : 0;
+
+    kafka_topic_rate_limiter* limiter = topic->rate_limiter;
+    if (limiter && !limiter->acquire(1, (int64_t)len)) {
+        if (limiter->limit().policy == rate_limit_spill && spillable &&
+            spill(topic_name, partition, msg_flags, payload, len, key_data, key_len, slot)) {
+            limiter->on_spilled();
+            return RdKafka::ERR_NO_ERROR;
+        }
+
+        limiter->on_rejected(1);
+        if (err_string) {
+            *err_string = "produce rate limit of topic " + topic_name + " exceeded";
+        }
+        return RdKafka::ERR__QUEUE_FULL;
+    }
+
+    // do not pile the messages up in memory while no broker is reachable
+    if (spillable && m_brokers_down.load(std::memory_order_relaxed) &&
+        spill(topic_name, partition, msg_flags, payload, len, key_data, key_len, slot)) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    auto res = produce_or_spill(topic, partition, msg_flags, payload, len, key, slot, spillable);
+
+    if (res != RdKafka::ERR_NO_ERROR) {
+        if (limiter) {
+            // the message never went out, its tokens are not used
+            limiter->refund(1, (int64_t)len);
+        }
+
+        if (is_unknown_topic_error(res)) {
+            topic->metadata_expire_time_ms = 0;
+            wakeup_metadata_thread();
+        }
+
+        if (err_string) {
+            *err_string = RdKafka::err2str(res);
+        }
+    }
+
+    return res;
+}
+
+RdKafka::ErrorCode kafka_producer::produce_topic(kafka_topic_entry* topic, int32_t partition, int32_t msg_flags,
+    char* payload, size_t len, const char* key, size_t key_len, void* opaque, bool envelope) {
+    if (!envelope) {
+        return m_producer->produce(topic->topic, partition, msg_flags, payload, len, key, key_len, opaque);
+    }
+
+    // only the produce by topic name takes headers, it resolves to the same rkt as the cached handle
+    RdKafka::Headers* headers = RdKafka::Headers::create();
+    headers->add(kafka_envelope::header_name(), "1", 1);
+
+    auto res = m_producer->produce(topic->name, partition, msg_flags, payload, len, key, key_len, 0, headers, opaque);
+    if (res != RdKafka::ERR_NO_ERROR) {
+        // librdkafka owns the headers only once the message is enqueued
+        delete headers;
+    }
+
+    return res;
+}
+
+bool    kafka_producer::is_spillable(int32_t msg_flags, kafka_delivery_slot* slot) const {
+    // borrowed payloads and messages whose result is awaited are not spilled
+    return m_spill_log && (slot ? !slot->observed() : msg_flags != 0);
+}
+
+RdKafka::ErrorCode kafka_producer::produce_or_spill(kafka_topic_entry* topic, int32_t partition, int32_t msg_flags,
+    char* payload, size_t len, const std::string* key, kafka_delivery_slot* slot, bool spillable) {
+    uint64_t seen_delivered_seq = m_delivered_seq.load();
+    auto res = produce_topic(topic, partition,
+        msg_flags,
         /* Value */
-        const_cast<char *>(msg.c_str()), msg.size(),
+        payload, len,
         /* Key */
         key ? key->c_str() : NULL, key ? key->size() : 0,
-        /* Timestamp (defaults to now) */
-        0,
-        /* Message headers, if any */
-        NULL,
         /* Per-message opaque value passed to
         * delivery report */
-        NULL);
+        slot, slot && slot->envelope);
 
-    if (res != RdKafka::ERR_NO_ERROR) {
-        if (err_string) {
-            *err_string = RdKafka::err2str(res);
+    if (res == RdKafka::ERR__QUEUE_FULL && m_options.backpressure_policy != backpressure_fail_fast) {
+        auto start_time = std::chrono::steady_clock::now();
+        auto deadline = start_time + std::chrono::milliseconds(m_options.backpressure_timeout_ms);
+        bool has_deadline = m_options.backpressure_policy == backpressure_block_with_deadline;
+
+        ++m_blocked_count;
+        ++m_total_blocked_count;
+
+        while (res == RdKafka::ERR__QUEUE_FULL) {
+            if (!wait_for_queue_space(seen_delivered_seq, has_deadline ? &deadline : nullptr)) {
+                break;
+            }
+
+            seen_delivered_seq = m_delivered_seq.load();
+            res = produce_topic(topic, partition, msg_flags, payload, len,
+                key ? key->c_str() : NULL, key ? key->size() : 0, slot, slot && slot->envelope);
         }
 
-        return false;
+        --m_blocked_count;
+        m_total_blocked_time_us += std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start_time).count();
     }
 
-    return true;
+    if (res == RdKafka::ERR__QUEUE_FULL && spillable &&
+        spill(topic->name, partition, msg_flags, payload, len, key ? key->data() : nullptr, key ? key->size() : 0, slot)) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    return res;
 }
 
 void    kafka_producer::dr_cb(RdKafka::Message& message) {
-    if (m_event_handler) {
-        m_event_handler->on_produce_msg_delivered(message);
+    kafka_delivery_slot* slot = static_cast<kafka_delivery_slot*>(message.msg_opaque());
+
+    // a spilled message is not reported, it gets its delivery report again when it is replayed
+    bool spilled = false;
+    if (m_spill_log && is_spillable_error(message.err()) && !(slot && slot->observed())) {
+        spilled = m_spill_log->append(message.topic_name(), message.partition(),
+            (const char*)message.key_pointer(), message.key_len(), (const char*)message.payload(), message.len(),
+            slot && slot->envelope);
+    }
+
+    if (m_event_handler && !spilled) {
+        if (m_options.batch_delivery_report) {
+            add_delivery_record(message, slot ? slot->user_opaque : nullptr);
+        }
+        else {
+            m_event_handler->on_produce_msg_delivered(message, slot ? slot->user_opaque : nullptr);
+        }
+    }
+
+    if (m_options.latency_histogram && message.err() == RdKafka::ERR_NO_ERROR) {
+        record_latency(message);
+    }
+
+    // the payload is not referenced by librdkafka anymore
+    if (slot) {
+        slot->complete(message.err(), message.partition(), message.offset());
+        slot->release();
+    }
+
+    if (is_unknown_topic_error(message.err())) {
+        invalidate_topic_metadata(message.topic_name());
+    }
+
+    // one more message left the local queue, wake the blocked producers
+    m_delivered_seq.fetch_add(1);
+    if (m_blocked_count.load() > 0) {
+        std::lock_guard<std::mutex> locker(m_backpressure_mtx);
+        m_backpressure_cv.notify_all();
     }
 }
 
@@ -119,6 +733,10 @@ void    kafka_producer::event_cb(RdKafka::Event &event) {
         //    run = false;
         //}
 
+        if (event.err() == RdKafka::ERR__ALL_BROKERS_DOWN) {
+            m_brokers_down = true;
+        }
+
         if (m_event_handler) {
             if (event.err() == RdKafka::ERR__ALL_BROKERS_DOWN) {
                 m_event_handler->on_produce_all_brokers_down_notify();
@@ -134,10 +752,16 @@ void    kafka_producer::event_cb(RdKafka::Event &event) {
     }
     case RdKafka::Event::EVENT_STATS:
     {
-        if (m_event_handler) {
+        if (m_event_handler || m_stats_observer) {
             std::string event_str(std::move(event.str()));
 
-            m_event_handler->on_produce_status(event_str);
+            if (m_stats_observer) {
+                m_stats_observer->on_stats(event_str);
+            }
+
+            if (m_event_handler) {
+                m_event_handler->on_produce_status(event_str);
+            }
         }
 
         break;
@@ -178,7 +802,7 @@ void    kafka_producer::event_cb(RdKafka::Event &event) {
 
 
 bool    kafka_producer::get_all_topic_metadata(RdKafka::Metadata** metadata, std::string* err_string) {
-    auto res = m_producer->metadata(true, NULL, metadata, 5000);
+    auto res = m_producer->metadata(true, NULL, metadata, m_options.metadata_timeout_ms);
 
     if (res != RdKafka::ERR_NO_ERROR && err_string) {
         *err_string = RdKafka::err2str(res);
@@ -188,56 +812,465 @@ bool    kafka_producer::get_all_topic_metadata(RdKafka::Metadata** metadata, std
 }
 
 bool    kafka_producer::get_topic_metadata(const std::string& topic_name, class RdKafka::Metadata** metadata, std::string* err_string) {
-    std::string err_string_inner;
-    RdKafka::Topic* topic = nullptr;
-    bool ret = true;
+    kafka_topic_entry* topic = get_topic(topic_name, err_string);
+    if (!topic) {
+        return false;
+    }
 
-    do {
-        topic = RdKafka::Topic::create(m_producer, topic_name, m_default_topic_conf, err_string_inner);
-        if (!topic) {
-            ret = false;
-            break;
-        }
+    auto res = m_producer->metadata(false, topic->topic, metadata, m_options.metadata_timeout_ms);
 
-        auto res = m_producer->metadata(false, topic,
-            metadata, 5000);
+    if (res != RdKafka::ERR_NO_ERROR && err_string) {
+        *err_string = RdKafka::err2str(res);
+    }
 
-        if (res != RdKafka::ERR_NO_ERROR) {
-            ret = false;
-            err_string_inner = RdKafka::err2str(res);
-        }
-    } while (0);
+    return res == RdKafka::ERR_NO_ERROR;
+}
+
+std::string kafka_producer::topic_name(int32_t topic_id) {
+    kafka_topic_entry* topic = m_topic_cache->get(topic_id);
+    return topic ? topic->name : std::string();
+}
+
+int32_t kafka_producer::partition_count(const std::string& topic_name) {
+    kafka_topic_entry* topic = m_topic_cache->find(topic_name);
+    if (!topic) {
+        return -1;
+    }
+
+    return topic->partition_count.load(std::memory_order_relaxed);
+}
+
+bool    kafka_producer::refresh_topic_metadata(const std::string& topic_name, std::string* err_string) {
+    kafka_topic_entry* topic = get_topic(topic_name, err_string);
+    if (!topic) {
+        return false;
+    }
+
+    auto res = fetch_topic_metadata(topic);
 
+    if (res != RdKafka::ERR_NO_ERROR && err_string) {
+        *err_string = RdKafka::err2str(res);
+    }
+
+    return res == RdKafka::ERR_NO_ERROR;
+}
+
+void    kafka_producer::invalidate_topic_metadata(const std::string& topic_name) {
+    kafka_topic_entry* topic = m_topic_cache->find(topic_name);
     if (topic) {
-        delete topic;
+        topic->metadata_expire_time_ms = 0;
+        wakeup_metadata_thread();
     }
+}
 
-    if (err_string) {
-        *err_string = err_string_inner;
+RdKafka::ErrorCode kafka_producer::fetch_topic_metadata(kafka_topic_entry* topic) {
+    RdKafka::Metadata* metadata = nullptr;
+    auto res = m_producer->metadata(false, topic->topic, &metadata, m_options.metadata_timeout_ms);
+
+    if (res == RdKafka::ERR_NO_ERROR) {
+        auto topics = metadata->topics();
+        if (topics->empty()) {
+            res = RdKafka::ERR__UNKNOWN_TOPIC;
+        }
+        else if ((*topics)[0]->err() != RdKafka::ERR_NO_ERROR) {
+            res = (*topics)[0]->err();
+        }
+        else {
+            topic->partition_count = (int32_t)(*topics)[0]->partitions()->size();
+        }
+    }
+
+    if (metadata) {
+        delete metadata;
+    }
+
+    // retry a failed fetch sooner than the ttl
+    int32_t next_refresh_ms = m_options.metadata_ttl_ms;
+    if (res != RdKafka::ERR_NO_ERROR && next_refresh_ms > 1000) {
+        next_refresh_ms = 1000;
+    }
+    topic->metadata_expire_time_ms = steady_now_ms() + next_refresh_ms;
+
+    return res;
+}
+
+bool    kafka_producer::get_topic_latency(const std::string& topic_name, kafka_latency_snapshot* snapshot, bool reset) {
+    kafka_topic_entry* topic = m_topic_cache->find(topic_name);
+    if (!topic) {
+        return false;
+    }
+
+    *snapshot = topic->latency.snapshot();
+    if (reset) {
+        topic->latency.reset();
+    }
+
+    return true;
+}
+
+void    kafka_producer::get_topic_latency(std::map<std::string, kafka_latency_snapshot>* snapshots, bool reset) {
+    for (auto topic : m_topic_cache->entries()) {
+        (*snapshots)[topic->name] = topic->latency.snapshot();
+        if (reset) {
+            topic->latency.reset();
+        }
     }
+}
 
-    return ret;
+void    kafka_producer::get_broker_latency(std::map<int32_t, kafka_latency_snapshot>* snapshots, bool reset) {
+    for (auto broker : m_broker_latency.values()) {
+        (*snapshots)[broker->broker_id] = broker->histogram.snapshot();
+        if (reset) {
+            broker->histogram.reset();
+        }
+    }
 }
 
 int32_t kafka_producer::out_queue_len() {
     return (int32_t)m_producer->outq_len();
 }
 
+kafka_backpressure_stats kafka_producer::get_backpressure_stats() {
+    kafka_backpressure_stats stats;
+    stats.blocked_producer_count = m_blocked_count.load();
+    stats.total_blocked_count = m_total_blocked_count.load();
+    stats.total_blocked_time_us = m_total_blocked_time_us.load();
+    return stats;
+}
+
+bool    kafka_producer::get_topic_rate_stats(const std::string& topic_name, kafka_topic_rate_stats* stats) {
+    auto iter = m_rate_limiters.find(topic_name);
+    if (iter == m_rate_limiters.end()) {
+        return false;
+    }
+
+    *stats = iter->second->stats();
+    return true;
+}
+
+void    kafka_producer::get_topic_rate_stats(std::map<std::string, kafka_topic_rate_stats>* stats) {
+    for (auto& limiter : m_rate_limiters) {
+        (*stats)[limiter.first] = limiter.second->stats();
+    }
+}
+
+kafka_spill_stats kafka_producer::get_spill_stats() {
+    if (!m_spill_log) {
+        return kafka_spill_stats();
+    }
+
+    return m_spill_log->get_stats();
+}
+
 void    kafka_producer::start() {
     m_work_thread_pool->start();
+
+    if (m_metadata_thread_pool) {
+        m_metadata_thread_pool->start();
+    }
+
+    if (m_spill_thread_pool) {
+        m_spill_thread_pool->start();
+    }
 }
 
 void    kafka_producer::stop() {
     m_work_thread_pool->stop();
+
+    if (m_metadata_thread_pool) {
+        m_metadata_thread_pool->stop();
+        wakeup_metadata_thread();
+    }
+
+    if (m_spill_thread_pool) {
+        m_spill_thread_pool->stop();
+    }
 }
 
 void    kafka_producer::wait_for_stop() {
     m_work_thread_pool->join_all();
+
+    if (m_metadata_thread_pool) {
+        m_metadata_thread_pool->join_all();
+    }
+
+    if (m_spill_thread_pool) {
+        m_spill_thread_pool->join_all();
+    }
+}
+
+bool    kafka_producer::shutdown(int32_t timeout_ms, kafka_shutdown_report* report) {
+    int64_t start_ms = steady_now_ms();
+    kafka_shutdown_report result;
+    int64_t spilled_before = get_spill_stats().spilled_count;
+
+    // no new messages from here on, the blocked producers give up
+    m_shutting_down = true;
+    {
+        std::lock_guard<std::mutex> locker(m_backpressure_mtx);
+        m_backpressure_cv.notify_all();
+    }
+
+    // the replay would refill the queue being flushed
+    if (m_spill_thread_pool) {
+        m_spill_thread_pool->stop();
+        m_spill_thread_pool->join_all();
+    }
+
+    if (m_metadata_thread_pool) {
+        m_metadata_thread_pool->stop();
+        wakeup_metadata_thread();
+        m_metadata_thread_pool->join_all();
+    }
+
+    if (m_producer) {
+        // serves the delivery reports on this thread too, the work threads keep polling meanwhile
+        m_producer->flush((std::max)(timeout_ms, 0));
+    }
+
+    m_work_thread_pool->stop();
+    m_work_thread_pool->join_all();
+
+    if (m_producer) {
+        result.undelivered_count = m_producer->outq_len();
+
+        if (result.undelivered_count > 0) {
+            m_producer->purge(RdKafka::Producer::PURGE_QUEUE | RdKafka::Producer::PURGE_INFLIGHT);
+
+            // the delivery reports of the purged messages, served until none is left or the deadline
+            int64_t deadline_ms = start_ms + (std::max)(timeout_ms, 0);
+            do {
+                int64_t remaining_ms = deadline_ms - steady_now_ms();
+                m_producer->poll((int32_t)(std::min)((std::max)(remaining_ms, (int64_t)0), (int64_t)100));
+            } while (m_producer->outq_len() > 0 && steady_now_ms() < deadline_ms);
+        }
+    }
+
+    result.spilled_count = get_spill_stats().spilled_count - spilled_before;
+
+    result.completed = result.undelivered_count == 0;
+    result.elapsed_ms = steady_now_ms() - start_ms;
+
+    if (report) {
+        *report = result;
+    }
+
+    return result.completed;
+}
+
+bool    kafka_producer::spill(const std::string& topic_name, int32_t partition, int32_t msg_flags,
+    char* payload, size_t len, const char* key, size_t key_len, kafka_delivery_slot* slot) {
+    if (!m_spill_log->append(topic_name, partition, key, key_len, payload, len, slot && slot->envelope)) {
+        return false;
+    }
+
+    // the spill log has its own copy, finish the payload as librdkafka would have
+    if (slot) {
+        slot->complete(RdKafka::ERR_NO_ERROR, partition, -1);
+        slot->release();
+    }
+    else if (msg_flags & RdKafka::Producer::RK_MSG_FREE) {
+        free(payload);
+    }
+
+    return true;
+}
+
+void    kafka_producer::add_delivery_record(RdKafka::Message& message, void* opaque) {
+    bool success = message.err() == RdKafka::ERR_NO_ERROR;
+
+    delivery_report_batch* batch = current_delivery_batch;
+    if (!batch || batch->owner != this) {
+        // not polled by a work thread, report it alone
+        kafka_delivery_record record;
+        fill_delivery_record(message, opaque, &record);
+
+        bool skip = success && m_options.delivery_report_failures_only;
+        m_event_handler->on_produce_msg_delivered_batch(skip ? nullptr : &record, skip ? 0 : 1, success ? 1 : 0);
+        return;
+    }
+
+    if (success) {
+        ++batch->success_count;
+
+        if (m_options.delivery_report_failures_only) {
+            return;
+        }
+    }
+
+    batch->records.push_back(kafka_delivery_record());
+    fill_delivery_record(message, opaque, &batch->records.back());
+}
+
+kafka_topic_entry* kafka_producer::find_delivery_topic(RdKafka::Message& message) {
+    // RdKafka::Message::topic() is always NULL in dr_cb, but the C++ topic handle is the opaque of its rkt
+    const rd_kafka_message_t* rk_message = message.c_ptr();
+    kafka_topic_entry* topic = nullptr;
+    if (rk_message && rk_message->rkt) {
+        topic = m_topic_cache->find(static_cast<const RdKafka::Topic*>(rd_kafka_topic_opaque(rk_message->rkt)));
+    }
+
+    return topic ? topic : m_topic_cache->find(message.topic_name());
+}
+
+void    kafka_producer::fill_delivery_record(RdKafka::Message& message, void* opaque, kafka_delivery_record* record) {
+    kafka_topic_entry* topic = find_delivery_topic(message);
+
+    record->topic_id = topic ? topic->topic_id : -1;
+    record->partition = message.partition();
+    record->offset = message.offset();
+    record->err = message.err();
+    record->opaque = opaque;
+    record->latency_us = message.latency();
+}
+
+void    kafka_producer::record_latency(RdKafka::Message& message) {
+    int64_t latency_us = message.latency();
+    if (latency_us < 0) {
+        return;
+    }
+
+    kafka_topic_entry* topic = find_delivery_topic(message);
+    if (topic) {
+        topic->latency.record(latency_us);
+    }
+
+    int32_t broker_id = rd_kafka_message_broker_id(message.c_ptr());
+    if (broker_id >= 0) {
+        kafka_broker_latency* broker = m_broker_latency.find(broker_id);
+        if (!broker) {
+            broker = m_broker_latency.get_or_create(broker_id, [](const int32_t& id) {
+                return new kafka_broker_latency(id);
+            });
+        }
+
+        broker->histogram.record(latency_us);
+    }
 }
 
 bool    kafka_producer::tick_func() {
-    int32_t event_count = m_producer->poll(0);
-    return event_count > 0;
+    static thread_local delivery_report_batch batch;
+    if (m_options.batch_delivery_report) {
+        batch.owner = this;
+        current_delivery_batch = &batch;
+    }
+
+    int32_t event_count = m_producer->poll(m_options.poll_timeout_ms);
+
+    if (m_options.batch_delivery_report) {
+        current_delivery_batch = nullptr;
+
+        if (m_event_handler && (!batch.records.empty() || batch.success_count > 0)) {
+            m_event_handler->on_produce_msg_delivered_batch(batch.records.empty() ? nullptr : &batch.records[0], 
+                (int32_t)batch.records.size(), batch.success_count);
+        }
+
+        batch.records.clear();
+        batch.success_count = 0;
+    }
+
+    // a blocking poll has waited already, no need to sleep in the thread pool
+    return event_count > 0 || m_options.poll_timeout_ms > 0;
+}
+
+bool    kafka_producer::spill_tick_func() {
+    int64_t now_ms = steady_now_ms();
+
+    if (m_brokers_down.load()) {
+        if (now_ms < m_spill_next_probe_ms) {
+            return false;
+        }
+        m_spill_next_probe_ms = now_ms + m_options.spill_probe_interval_ms;
+
+        // the metadata request succeeds only if some broker answers
+        RdKafka::Metadata* metadata = nullptr;
+        if (m_producer->metadata(false, nullptr, &metadata, m_options.metadata_timeout_ms) != RdKafka::ERR_NO_ERROR) {
+            return false;
+        }
+
+        delete metadata;
+        m_brokers_down = false;
+    }
+
+    if (m_spill_log->empty()) {
+        m_spill_last_replay_ms = now_ms;
+        return false;
+    }
+
+    // token bucket refilled at spill_replay_rate, bursts up to 100ms worth of messages
+    double max_credit = (std::max)(m_options.spill_replay_rate / 10.0, 1.0);
+    m_spill_replay_credit = (std::min)(max_credit, 
+        m_spill_replay_credit + (now_ms - m_spill_last_replay_ms) * m_options.spill_replay_rate / 1000.0);
+    m_spill_last_replay_ms = now_ms;
+
+    kafka_spill_record record;
+    int32_t replayed_count = 0;
+
+    while (m_spill_replay_credit >= 1.0 && !m_brokers_down.load(std::memory_order_relaxed) && m_spill_log->peek(&record)) {
+        std::string err_string;
+        kafka_topic_entry* topic = get_topic(record.topic_name, &err_string);
+
+        RdKafka::ErrorCode res = RdKafka::ERR__INVALID_ARG;
+        if (topic) {
+            res = produce_topic(topic, record.partition, RdKafka::Producer::RK_MSG_COPY,
+                const_cast<char *>(record.payload.data()), record.payload.size(),
+                record.has_key ? record.key.data() : NULL, record.has_key ? record.key.size() : 0, nullptr, record.envelope);
+        }
+
+        if (res == RdKafka::ERR__QUEUE_FULL) {
+            // try again when the local queue has drained
+            break;
+        }
+
+        // other enqueue errors will not go away by retrying
+        m_spill_log->pop(res == RdKafka::ERR_NO_ERROR);
+        m_spill_replay_credit -= 1.0;
+        ++replayed_count;
+
+        if (res != RdKafka::ERR_NO_ERROR && m_event_handler) {
+            m_event_handler->on_produce_error("spill replay to " + record.topic_name + " dropped", 
+                err_string.empty() ? RdKafka::err2str(res) : err_string);
+        }
+    }
+
+    for (auto& error : m_spill_log->take_errors()) {
+        if (m_event_handler) {
+            m_event_handler->on_produce_error("spill segment quarantined", error);
+        }
+    }
+
+    return replayed_count > 0;
+}
+
+bool    kafka_producer::metadata_tick_func() {
+    int64_t now_ms = steady_now_ms();
+    int64_t next_refresh_ms = now_ms + m_options.metadata_ttl_ms;
+
+    for (auto topic : m_topic_cache->entries()) {
+        if (topic->metadata_expire_time_ms.load(std::memory_order_relaxed) <= now_ms) {
+            fetch_topic_metadata(topic);
+        }
+
+        next_refresh_ms = (std::min)(next_refresh_ms, topic->metadata_expire_time_ms.load(std::memory_order_relaxed));
+    }
+
+    // sleep until the next topic expires, a new topic, an invalidation or stop wakes it earlier
+    std::unique_lock<std::mutex> locker(m_metadata_mtx);
+    m_metadata_cv.wait_for(locker, std::chrono::milliseconds((std::max)(next_refresh_ms - steady_now_ms(), (int64_t)0)),
+        [this]() { return m_metadata_wakeup; });
+    m_metadata_wakeup = false;
+
+    return true;
+}
+
+void    kafka_producer::wakeup_metadata_thread() {
+    if (!m_metadata_thread_pool) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> locker(m_metadata_mtx);
+    m_metadata_wakeup = true;
+    m_metadata_cv.notify_one();
 }
 
 }   // end namespace utility
@@ -11,14 +11,47 @@
 #define __utility_common_kafka_producer_h__
 
 #include "kafka_common.h"
+#include "kafka_produce_future.hpp"
+#include "kafka_latency_histogram.hpp"
+#include "kafka_append_only_map.hpp"
+#include "kafka_spill_log.h"
+#include "kafka_rate_limiter.hpp"
 #include <string>
+#include <map>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <rdkafkacpp.h>
-#include <string>
 
 namespace utility {
 
 class kafka_producer_event_handler;
 class kafka_thread_pool;
+class kafka_topic_cache;
+class kafka_stats_observer;
+struct kafka_topic_entry;
+/** what produce does when the librdkafka local queue is full */
+enum kafka_backpressure_policy {
+    backpressure_fail_fast,             /** return false with ERR__QUEUE_FULL at once */
+    backpressure_block_with_deadline,   /** wait for delivery reports up to backpressure_timeout_ms */
+    backpressure_block,                 /** wait for delivery reports until there is space */
+};
+
+struct kafka_backpressure_stats {
+    int32_t     blocked_producer_count;     /** threads blocked in produce right now */
+    int64_t     total_blocked_count;        /** times produce has been blocked */
+    int64_t     total_blocked_time_us;      /** total time spent blocked */
+
+    kafka_backpressure_stats() 
+        : blocked_producer_count(0)
+        , total_blocked_count(0)
+        , total_blocked_time_us(0){
+    }
+};
+
 struct kafka_producer_options {
     std::string broker_list;
     bool        use_sasl;
@@ -26,8 +59,82 @@ struct kafka_producer_options {
     std::string sasl_password;
     std::string debug;
     RdKafka::PartitionerCb* partitioner_cb;
+    /* <topic_name, <conf_name, conf_value> >, topic conf override the default topic conf */
+    std::map<std::string, std::map<std::string, std::string> > topic_conf;
+    kafka_backpressure_policy   backpressure_policy;
+    int32_t                     backpressure_timeout_ms;
+    /** 
+     * work threads block in poll up to poll_timeout_ms and wake as soon as a delivery report 
+     * or event arrives; 0 polls without blocking and sleeps 10ms when idle
+     */
+    int32_t                     poll_timeout_ms;
+    /** 
+     * metadata cache of the topics in use is refreshed in background every metadata_ttl_ms;
+     * 0 starts no metadata thread, the cache is then filled by refresh_topic_metadata only
+     */
+    int32_t                     metadata_ttl_ms;
+    /** timeout of the metadata requests to the brokers */
+    int32_t                     metadata_timeout_ms;
+    /** librdkafka statistics.interval.ms, 0 to keep the default; a partitioner_cb observing the statistics needs it */
+    int32_t                     statistics_interval_ms;
+    /** deliver the reports of each poll cycle through on_produce_msg_delivered_batch */
+    bool                        batch_delivery_report;
+    /** with batch_delivery_report, successful deliveries are only counted */
+    bool                        delivery_report_failures_only;
+    /** record the produce to delivery report latency per topic and per broker, see kafka_producer::get_topic_latency; off by default */
+    bool                        latency_histogram;
+    /** 
+     * spill mode is on if spill_dir is not empty: while all the brokers are down, when the local queue is full,
+     * or when a message fails with a transient error, it is written to a memory-mapped segment log in spill_dir
+     * instead of being dropped, and replayed at up to spill_replay_rate msgs/s once the brokers are reachable;
+     * messages whose result is awaited(futures, callbacks, batch report opaques) and borrowed payloads are never spilled,
+     * replayed messages may be out of order with the live ones
+     */
+    std::string                 spill_dir;
+    int64_t                     spill_segment_size;
+    /** cap of the disk usage, 0 for no limit */
+    int64_t                     spill_max_bytes;
+    int32_t                     spill_replay_rate;
+    /** how often the brokers are probed while they are down */
+    int32_t                     spill_probe_interval_ms;
+    /** 
+     * <topic_name, limit>, produce rate limits enforced locally by produce_msg and produce_batch;
+     * produce_batch takes the tokens of the whole batch at once; the tokens of the messages that fail are given back
+     */
+    std::map<std::string, kafka_topic_rate_limit> topic_rate_limit;
 
-    kafka_producer_options() : use_sasl(false), partitioner_cb(nullptr){
+    kafka_producer_options() 
+        : use_sasl(false)
+        , partitioner_cb(nullptr)
+        , backpressure_policy(backpressure_fail_fast)
+        , backpressure_timeout_ms(1000)
+        , poll_timeout_ms(100)
+        , metadata_ttl_ms(0)
+        , metadata_timeout_ms(5000)
+        , statistics_interval_ms(0)
+        , batch_delivery_report(false)
+        , delivery_report_failures_only(false)
+        , latency_histogram(false)
+        , spill_segment_size(64 * 1024 * 1024)
+        , spill_max_bytes(0)
+        , spill_replay_rate(10000)
+        , spill_probe_interval_ms(1000){
+    }
+};
+
+/** one record of kafka_producer::produce_batch */
+struct kafka_produce_record {
+    const char*         payload;
+    size_t              len;
+    const std::string*  key;
+    void*               opaque;     /** passed back in kafka_delivery_record::opaque */
+    RdKafka::ErrorCode  err;        /** per-record result, set by produce_batch */
+
+    kafka_produce_record() : payload(nullptr), len(0), key(nullptr), opaque(nullptr), err(RdKafka::ERR_NO_ERROR) {
+    }
+
+    kafka_produce_record(const char* p, size_t l, const std::string* k = nullptr, void* o = nullptr)
+        : payload(p), len(l), key(k), opaque(o), err(RdKafka::ERR_NO_ERROR) {
     }
 };
 
@@ -35,13 +142,58 @@ class kafka_producer :
     public RdKafka::EventCb,
     public RdKafka::DeliveryReportCb
 {
+    /** merges the latency histograms of its shards */
+    friend class kafka_producer_group;
+
+public:
+    /** how the zero-copy produce_msg overloads treat the payload buffer */
+    enum payload_policy {
+        payload_copy,       /** librdkafka copies the payload(RK_MSG_COPY) */
+        payload_borrow,     /** caller keeps the payload alive until it is reported by on_produce_msg_delivered */
+        payload_free,       /** payload is malloc'ed, librdkafka free() it after the delivery report(RK_MSG_FREE) */
+    };
+
+    /** release a payload after its delivery report, see produce_msg(..., const payload_deleter&, ...) */
+    typedef kafka_delivery_slot::payload_deleter payload_deleter;
+
+    /** per-message completion, called from dr_cb, see produce_msg_async */
+    typedef kafka_delivery_slot::delivery_callback delivery_callback;
+
 protected:
     kafka_thread_pool*              m_work_thread_pool;
+    kafka_thread_pool*              m_metadata_thread_pool;
     kafka_producer_event_handler*   m_event_handler;
     kafka_producer_options          m_options;
     RdKafka::Conf*                  m_global_conf;
     RdKafka::Conf*                  m_default_topic_conf;
     RdKafka::Producer*              m_producer;
+    kafka_topic_cache*              m_topic_cache;
+    kafka_delivery_slot_pool*       m_slot_pool;
+    kafka_stats_observer*           m_stats_observer;
+    std::mutex                      m_backpressure_mtx;
+    std::condition_variable         m_backpressure_cv;
+    std::atomic<uint64_t>           m_delivered_seq;
+    std::atomic<int32_t>            m_blocked_count;
+    std::atomic<int64_t>            m_total_blocked_count;
+    std::atomic<int64_t>            m_total_blocked_time_us;
+    kafka_append_only_map<int32_t, kafka_broker_latency>    m_broker_latency;
+    kafka_spill_log*                m_spill_log;
+    kafka_thread_pool*              m_spill_thread_pool;
+    /** set by the all brokers down event, cleared when a probe reaches the brokers */
+    std::atomic<bool>               m_brokers_down;
+    int64_t                         m_spill_next_probe_ms;
+    int64_t                         m_spill_last_replay_ms;
+    double                          m_spill_replay_credit;
+    /** built from the options in the constructor, read-only afterwards */
+    std::map<std::string, kafka_topic_rate_limiter*>    m_rate_limiters;
+    /** set by kafka_producer_group, its shards share the limiters it owns */
+    bool                            m_rate_limiters_shared;
+    /** set by shutdown, produce fails with ERR__STATE afterwards */
+    std::atomic<bool>               m_shutting_down;
+    /** the metadata thread sleeps on it until the next topic expires */
+    std::mutex                      m_metadata_mtx;
+    std::condition_variable         m_metadata_cv;
+    bool                            m_metadata_wakeup;
 
 public:
     static std::string error_to_string(int32_t error_code);
@@ -54,13 +206,105 @@ public:
     void    set_event_handler(kafka_producer_event_handler* handler);
     bool    produce_msg(const std::string& topic_name, const std::string& msg, const std::string* key, std::string* err_string);
     bool    produce_msg(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, std::string* err_string);
+
+    /** 
+     * zero-copy produce, the moved-in msg is kept until its delivery report;
+     * on failure msg is moved back so the caller can retry.
+     * a distinct name, so that temporaries given to produce_msg keep the plain RK_MSG_COPY path
+     */
+    bool    produce_msg_move(const std::string& topic_name, std::string&& msg, const std::string* key, std::string* err_string);
+    bool    produce_msg_move(const std::string& topic_name, int32_t partition, std::string&& msg, const std::string* key, std::string* err_string);
+
+    /** 
+     * produce_msg_move of a kafka_envelope, marked by the kafka_envelope header so that
+     * the consumers with unpack_envelopes split it; used by kafka_msg_packer
+     */
+    bool    produce_envelope_move(const std::string& topic_name, int32_t partition, std::string&& envelope, const std::string* key, std::string* err_string);
+
+    /** 
+     * zero-copy produce, the payload is handled as the policy says;
+     * on failure the caller still owns the payload
+     */
+    bool    produce_msg(const std::string& topic_name, int32_t partition, const char* payload, size_t len, payload_policy policy, const std::string* key, std::string* err_string);
+
+    /** 
+     * zero-copy produce, deleter is called from dr_cb after on_produce_msg_delivered;
+     * on failure the caller still owns the payload and deleter is not called
+     */
+    bool    produce_msg(const std::string& topic_name, int32_t partition, char* payload, size_t len, const payload_deleter& deleter, const std::string* key, std::string* err_string);
+
+
+    /** 
+     * async produce, the future is completed by the message's delivery report;
+     * if the message is not enqueued the future is ready at once with the error
+     */
+    kafka_produce_future produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key);
+
+    /** 
+     * async produce, callback is called from dr_cb with the delivery result;
+     * it is not called if the message is not enqueued
+     */
+    bool    produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, 
+        const delivery_callback& callback, std::string* err_string);
+
+    /** 
+     * produce all the records with a single librdkafka call, 
+     * returns the count of records enqueued or spilled, the failed ones have their err set;
+     * the records the queue had no room for go through backpressure_policy and the spill log as produce_msg does.
+     * payload_borrow/payload_free records that failed are still owned by the caller
+     */
+    int32_t produce_batch(const std::string& topic_name, int32_t partition, std::vector<kafka_produce_record>& records, payload_policy policy = payload_copy);
+
     bool    get_all_topic_metadata(RdKafka::Metadata** metadata, std::string* err_string);
     bool    get_topic_metadata(const std::string& topic_name, class RdKafka::Metadata** metadata, std::string* err_string);
+
+    /** 
+     * partition count from the metadata cache, no network I/O and no topic handle is created;
+     * returns -1 if the topic metadata is not fetched yet
+     */
+    int32_t partition_count(const std::string& topic_name);
+
+    /** name of kafka_delivery_record::topic_id */
+    std::string topic_name(int32_t topic_id);
+
+    /** fetch the topic metadata into the cache now */
+    bool    refresh_topic_metadata(const std::string& topic_name, std::string* err_string);
+
+    /** mark the cached topic metadata stale, it will be fetched again in background */
+    void    invalidate_topic_metadata(const std::string& topic_name);
+
     int32_t out_queue_len();
+    kafka_backpressure_stats get_backpressure_stats();
+
+    /** 
+     * latency percentiles of the messages delivered to the topic so far, false if nothing is produced to it;
+     * with reset the histogram restarts, records racing with the reset may be lost
+     */
+    bool    get_topic_latency(const std::string& topic_name, kafka_latency_snapshot* snapshot, bool reset = false);
+    void    get_topic_latency(std::map<std::string, kafka_latency_snapshot>* snapshots, bool reset = false);
+
+    /** latency percentiles per leader broker id */
+    void    get_broker_latency(std::map<int32_t, kafka_latency_snapshot>* snapshots, bool reset = false);
+
+    /** spill log counters, all zero if spill mode is off */
+    kafka_spill_stats get_spill_stats();
+
+    /** token state and throttle counters of a rate limited topic, false if the topic has no limit */
+    bool    get_topic_rate_stats(const std::string& topic_name, kafka_topic_rate_stats* stats);
+    void    get_topic_rate_stats(std::map<std::string, kafka_topic_rate_stats>* stats);
+
     void    start();
     void    stop();
     void    wait_for_stop();
 
+    /** 
+     * stops the produce, flushes the local queue for up to timeout_ms, then purges what is left:
+     * the purged messages get failed delivery reports, or are spilled in spill mode; stops all the threads.
+     * true if everything was delivered; the destructor does shutdown(0) if it was not called,
+     * then serves the reports left for up to 1s and fails the futures, callbacks and deleters of the rest with ERR__DESTROY
+     */
+    bool    shutdown(int32_t timeout_ms, kafka_shutdown_report* report = nullptr);
+
 protected:
     /* implement the interface from DeliveryReportCb **/
     void    dr_cb(RdKafka::Message& message) override;
@@ -69,7 +313,31 @@ protected:
     void    event_cb(RdKafka::Event &event) override;
 
 private:
+    static int32_t msg_flags_of(payload_policy policy);
+    kafka_topic_entry*  get_topic(const std::string& topic_name, std::string* err_string);
+    RdKafka::Topic*     create_topic(const std::string& topic_name, std::string* err_string);
+    bool    wait_for_queue_space(uint64_t seen_delivered_seq, const std::chrono::steady_clock::time_point* deadline);
+    RdKafka::ErrorCode  produce_impl(const std::string& topic_name, int32_t partition, int32_t msg_flags, 
+        char* payload, size_t len, const std::string* key, kafka_delivery_slot* slot, std::string* err_string);
+    /** produce, waiting for queue space as backpressure_policy says, then spilling a message the queue has no room for */
+    RdKafka::ErrorCode  produce_or_spill(kafka_topic_entry* topic, int32_t partition, int32_t msg_flags, 
+        char* payload, size_t len, const std::string* key, kafka_delivery_slot* slot, bool spillable);
+    bool    is_spillable(int32_t msg_flags, kafka_delivery_slot* slot) const;
+    /** a single produce to the cached topic handle, with the kafka_envelope header if envelope */
+    RdKafka::ErrorCode  produce_topic(kafka_topic_entry* topic, int32_t partition, int32_t msg_flags, 
+        char* payload, size_t len, const char* key, size_t key_len, void* opaque, bool envelope);
+    bool    produce_owned(const std::string& topic_name, int32_t partition, std::string&& msg, const std::string* key, bool envelope, std::string* err_string);
+    RdKafka::ErrorCode  fetch_topic_metadata(kafka_topic_entry* topic);
+    void    add_delivery_record(RdKafka::Message& message, void* opaque);
+    kafka_topic_entry*  find_delivery_topic(RdKafka::Message& message);
+    void    fill_delivery_record(RdKafka::Message& message, void* opaque, struct kafka_delivery_record* record);
+    void    record_latency(RdKafka::Message& message);
+    bool    spill(const std::string& topic_name, int32_t partition, int32_t msg_flags,
+        char* payload, size_t len, const char* key, size_t key_len, kafka_delivery_slot* slot);
+    bool    spill_tick_func();
     bool    tick_func();
+    bool    metadata_tick_func();
+    void    wakeup_metadata_thread();
 };
 
 } // end namespace utility
@@ -16,6 +16,17 @@
 
 namespace utility
 {
+/** compact delivery report, see kafka_producer_options::batch_delivery_report */
+struct kafka_delivery_record
+{
+    int32_t             topic_id;       /** kafka_producer::topic_name(topic_id), -1 if unknown */
+    int32_t             partition;
+    int64_t             offset;
+    RdKafka::ErrorCode  err;
+    void*               opaque;         /** kafka_produce_record::opaque */
+    int64_t             latency_us;     /** from produce to the delivery report, -1 if unknown */
+};
+
 class kafka_producer_event_handler
 {
 public:
@@ -44,6 +55,21 @@ public:
 
     /** event message delivery*/
     virtual void    on_produce_msg_delivered(RdKafka::Message& message){}
+
+    /** 
+     * event message delivery with the kafka_produce_record::opaque, nullptr if the message has none;
+     * message.msg_opaque() belongs to the producer, forwards to on_produce_msg_delivered(message) by default
+     */
+    virtual void    on_produce_msg_delivered(RdKafka::Message& message, void* opaque){
+        on_produce_msg_delivered(message);
+    }
+
+    /** 
+     * the delivery reports of one poll cycle, instead of on_produce_msg_delivered, if batch_delivery_report is on;
+     * success_count counts all the successful deliveries of the cycle, including the ones left out of records 
+     * when delivery_report_failures_only is on
+     */
+    virtual void    on_produce_msg_delivered_batch(const kafka_delivery_record* records, int32_t record_count, int64_t success_count){}
 };
 }
 
@@ -0,0 +1,474 @@
+﻿#include "kafka_producer_group.h"
+#include "kafka_topic_cache.hpp"
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+namespace utility
+{
+
+static inline uint32_t shard_hash(const char* str, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t current_thread_index() {
+    static std::atomic<uint32_t> next_thread_index(0);
+    static thread_local uint32_t thread_index = next_thread_index++;
+    return thread_index;
+}
+
+class kafka_producer_group::shard_event_handler : public kafka_producer_event_handler
+{
+protected:
+    kafka_producer_group*   m_group;
+    kafka_producer*         m_shard;
+    std::atomic<bool>       m_brokers_down;
+    /** <topic id of the shard, group wide topic id> */
+    kafka_append_only_map<int32_t, int32_t> m_topic_ids;
+
+public:
+    shard_event_handler(kafka_producer_group* group, kafka_producer* shard)
+        : m_group(group)
+        , m_shard(shard)
+        , m_brokers_down(false){
+    }
+
+public:
+    void    on_produce_all_brokers_down_notify() override {
+        // the brokers are the same for all the shards, the first one tells
+        if (!m_brokers_down.exchange(true) && m_group->m_down_shard_count++ == 0) {
+            m_group->m_event_handler->on_produce_all_brokers_down_notify();
+        }
+    }
+
+    void    on_produce_error(const std::string& event_str, const std::string& error_desc) override {
+        m_group->m_event_handler->on_produce_error(event_str, error_desc);
+    }
+
+    void    on_produce_status(const std::string& status) override {
+        m_group->m_event_handler->on_produce_status(status);
+    }
+
+    void    on_produce_log(int32_t log_level, const std::string& fac, const std::string& msg) override {
+        m_group->m_event_handler->on_produce_log(log_level, fac, msg);
+    }
+
+    void    on_produce_throttle(int32_t throttle_time, const std::string& broker_name, int32_t broker_id) override {
+        m_group->m_event_handler->on_produce_throttle(throttle_time, broker_name, broker_id);
+    }
+
+    void    on_produce_uknow_event(int32_t event_type, const std::string& event_str, const std::string& error_desc) override {
+        m_group->m_event_handler->on_produce_uknow_event(event_type, event_str, error_desc);
+    }
+
+    void    on_produce_msg_delivered(RdKafka::Message& message) override {
+        if (message.err() == RdKafka::ERR_NO_ERROR) {
+            brokers_up();
+        }
+
+        m_group->m_event_handler->on_produce_msg_delivered(message);
+    }
+
+    void    on_produce_msg_delivered(RdKafka::Message& message, void* opaque) override {
+        if (message.err() == RdKafka::ERR_NO_ERROR) {
+            brokers_up();
+        }
+
+        m_group->m_event_handler->on_produce_msg_delivered(message, opaque);
+    }
+
+    void    on_produce_msg_delivered_batch(const kafka_delivery_record* records, int32_t record_count, int64_t success_count) override {
+        if (success_count > 0) {
+            brokers_up();
+        }
+
+        if (record_count <= 0) {
+            m_group->m_event_handler->on_produce_msg_delivered_batch(nullptr, 0, success_count);
+            return;
+        }
+
+        // one poll cycle at a time per thread, the buffer is reused
+        static thread_local std::vector<kafka_delivery_record> group_records;
+        group_records.assign(records, records + record_count);
+        for (auto& record : group_records) {
+            record.topic_id = group_topic_id(record.topic_id);
+        }
+
+        m_group->m_event_handler->on_produce_msg_delivered_batch(&group_records[0], record_count, success_count);
+    }
+
+protected:
+    void    brokers_up() {
+        if (m_brokers_down.load(std::memory_order_relaxed) && m_brokers_down.exchange(false)) {
+            --m_group->m_down_shard_count;
+        }
+    }
+
+    int32_t group_topic_id(int32_t topic_id) {
+        if (topic_id < 0) {
+            return -1;
+        }
+
+        int32_t* group_id = m_topic_ids.get_or_create(topic_id, [this](const int32_t& id) {
+            return new int32_t(m_group->group_topic_id(m_shard->topic_name(id)));
+        });
+        return *group_id;
+    }
+};
+
+kafka_producer_group::kafka_producer_group(const kafka_producer_options& options, int32_t shard_count, 
+    int32_t work_thread_count_per_shard, kafka_shard_routing routing)
+    : m_routing(routing)
+    , m_event_handler(nullptr)
+    , m_down_shard_count(0)
+    , m_next_topic_id(0){
+    if (shard_count < 1) {
+        shard_count = 1;
+    }
+
+    for (auto& limit : options.topic_rate_limit) {
+        m_rate_limiters[limit.first] = new kafka_topic_rate_limiter(limit.second);
+    }
+
+    for (int32_t i = 0; i < shard_count; ++i) {
+        kafka_producer_options shard_options = options;
+
+        // a spill log is owned by one producer
+        if (!shard_options.spill_dir.empty()) {
+            shard_options.spill_dir += "_shard" + std::to_string(i);
+        }
+
+        // the shards use the limiters of the group instead of their own
+        shard_options.topic_rate_limit.clear();
+
+        // a kafka_stats_observer partitioner merges the statistics of all the shards
+        kafka_producer* shard = new kafka_producer(shard_options, work_thread_count_per_shard);
+
+        // before any topic is created, the topics pick their limiter up at creation
+        shard->m_rate_limiters = m_rate_limiters;
+        shard->m_rate_limiters_shared = true;
+        m_shards.push_back(shard);
+        m_shard_handlers.push_back(new shard_event_handler(this, m_shards.back()));
+    }
+}
+
+kafka_producer_group::~kafka_producer_group() {
+    for (auto shard : m_shards) {
+        delete shard;
+    }
+    m_shards.clear();
+
+    for (auto handler : m_shard_handlers) {
+        delete handler;
+    }
+    m_shard_handlers.clear();
+
+    for (auto& limiter : m_rate_limiters) {
+        delete limiter.second;
+    }
+    m_rate_limiters.clear();
+}
+
+void    kafka_producer_group::set_event_handler(kafka_producer_event_handler* handler) {
+    m_event_handler = handler;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        m_shards[i]->set_event_handler(handler ? m_shard_handlers[i] : nullptr);
+    }
+}
+
+bool    kafka_producer_group::produce_msg(const std::string& topic_name, const std::string& msg, const std::string* key, std::string* err_string) {
+    return route(key)->produce_msg(topic_name, msg, key, err_string);
+}
+
+bool    kafka_producer_group::produce_msg(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, std::string* err_string) {
+    return route(key)->produce_msg(topic_name, partition, msg, key, err_string);
+}
+
+bool    kafka_producer_group::produce_msg_move(const std::string& topic_name, std::string&& msg, const std::string* key, std::string* err_string) {
+    return route(key)->produce_msg_move(topic_name, std::move(msg), key, err_string);
+}
+
+bool    kafka_producer_group::produce_msg_move(const std::string& topic_name, int32_t partition, std::string&& msg, const std::string* key, std::string* err_string) {
+    return route(key)->produce_msg_move(topic_name, partition, std::move(msg), key, err_string);
+}
+
+bool    kafka_producer_group::produce_envelope_move(const std::string& topic_name, int32_t partition, std::string&& envelope, const std::string* key, std::string* err_string) {
+    return route(key)->produce_envelope_move(topic_name, partition, std::move(envelope), key, err_string);
+}
+
+bool    kafka_producer_group::produce_msg(const std::string& topic_name, int32_t partition, const char* payload, size_t len, 
+    kafka_producer::payload_policy policy, const std::string* key, std::string* err_string) {
+    return route(key)->produce_msg(topic_name, partition, payload, len, policy, key, err_string);
+}
+
+bool    kafka_producer_group::produce_msg(const std::string& topic_name, int32_t partition, char* payload, size_t len, 
+    const kafka_producer::payload_deleter& deleter, const std::string* key, std::string* err_string) {
+    return route(key)->produce_msg(topic_name, partition, payload, len, deleter, key, err_string);
+}
+
+kafka_produce_future kafka_producer_group::produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key) {
+    return route(key)->produce_msg_async(topic_name, partition, msg, key);
+}
+
+bool    kafka_producer_group::produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, 
+    const kafka_producer::delivery_callback& callback, std::string* err_string) {
+    return route(key)->produce_msg_async(topic_name, partition, msg, key, callback, err_string);
+}
+
+int32_t kafka_producer_group::produce_batch(const std::string& topic_name, int32_t partition, std::vector<kafka_produce_record>& records, 
+    kafka_producer::payload_policy policy) {
+    bool keyed = false;
+    if (m_routing == shard_by_key) {
+        for (auto& record : records) {
+            if (record.key) {
+                keyed = true;
+                break;
+            }
+        }
+    }
+
+    if (!keyed) {
+        return route(nullptr)->produce_batch(topic_name, partition, records, policy);
+    }
+
+    // <shard index, indexes of its records>
+    std::vector<std::vector<size_t>> shard_records(m_shards.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        shard_records[route_index(records[i].key)].push_back(i);
+    }
+
+    int32_t produced_count = 0;
+    std::vector<kafka_produce_record> shard_batch;
+    for (size_t shard_index = 0; shard_index < m_shards.size(); ++shard_index) {
+        if (shard_records[shard_index].empty()) {
+            continue;
+        }
+
+        shard_batch.clear();
+        for (auto index : shard_records[shard_index]) {
+            shard_batch.push_back(records[index]);
+        }
+
+        produced_count += m_shards[shard_index]->produce_batch(topic_name, partition, shard_batch, policy);
+
+        for (size_t i = 0; i < shard_batch.size(); ++i) {
+            records[shard_records[shard_index][i]].err = shard_batch[i].err;
+        }
+    }
+
+    return produced_count;
+}
+
+int32_t kafka_producer_group::partition_count(const std::string& topic_name) {
+    // only the shards which produced to the topic have it cached
+    for (auto shard : m_shards) {
+        int32_t count = shard->partition_count(topic_name);
+        if (count >= 0) {
+            return count;
+        }
+    }
+
+    return -1;
+}
+
+std::string kafka_producer_group::topic_name(int32_t topic_id) {
+    group_topic* topic = m_topics.at(topic_id);
+    return topic ? topic->name : std::string();
+}
+
+int32_t kafka_producer_group::out_queue_len() {
+    int32_t len = 0;
+    for (auto shard : m_shards) {
+        len += shard->out_queue_len();
+    }
+    return len;
+}
+
+kafka_spill_stats kafka_producer_group::get_spill_stats() {
+    kafka_spill_stats total;
+    for (auto shard : m_shards) {
+        kafka_spill_stats stats = shard->get_spill_stats();
+        total.spilled_count += stats.spilled_count;
+        total.replayed_count += stats.replayed_count;
+        total.dropped_count += stats.dropped_count;
+        total.pending_count += stats.pending_count;
+        total.pending_bytes += stats.pending_bytes;
+        total.segment_count += stats.segment_count;
+        total.quarantined_count += stats.quarantined_count;
+    }
+    return total;
+}
+
+bool    kafka_producer_group::get_topic_latency(const std::string& topic_name, kafka_latency_snapshot* snapshot, bool reset) {
+    kafka_latency_histogram histogram;
+    bool found = false;
+    for (auto shard : m_shards) {
+        kafka_topic_entry* topic = shard->m_topic_cache->find(topic_name);
+        if (!topic) {
+            continue;
+        }
+
+        found = true;
+        histogram.merge(topic->latency);
+        if (reset) {
+            topic->latency.reset();
+        }
+    }
+
+    if (found) {
+        *snapshot = histogram.snapshot();
+    }
+
+    return found;
+}
+
+void    kafka_producer_group::get_topic_latency(std::map<std::string, kafka_latency_snapshot>* snapshots, bool reset) {
+    std::map<std::string, kafka_latency_histogram> histograms;
+    for (auto shard : m_shards) {
+        for (auto topic : shard->m_topic_cache->entries()) {
+            histograms[topic->name].merge(topic->latency);
+            if (reset) {
+                topic->latency.reset();
+            }
+        }
+    }
+
+    for (auto& histogram : histograms) {
+        (*snapshots)[histogram.first] = histogram.second.snapshot();
+    }
+}
+
+void    kafka_producer_group::get_broker_latency(std::map<int32_t, kafka_latency_snapshot>* snapshots, bool reset) {
+    std::map<int32_t, kafka_latency_histogram> histograms;
+    for (auto shard : m_shards) {
+        for (auto broker : shard->m_broker_latency.values()) {
+            histograms[broker->broker_id].merge(broker->histogram);
+            if (reset) {
+                broker->histogram.reset();
+            }
+        }
+    }
+
+    for (auto& histogram : histograms) {
+        (*snapshots)[histogram.first] = histogram.second.snapshot();
+    }
+}
+
+bool    kafka_producer_group::get_topic_rate_stats(const std::string& topic_name, kafka_topic_rate_stats* stats) {
+    auto iter = m_rate_limiters.find(topic_name);
+    if (iter == m_rate_limiters.end()) {
+        return false;
+    }
+
+    *stats = iter->second->stats();
+    return true;
+}
+
+void    kafka_producer_group::get_topic_rate_stats(std::map<std::string, kafka_topic_rate_stats>* stats) {
+    for (auto& limiter : m_rate_limiters) {
+        (*stats)[limiter.first] = limiter.second->stats();
+    }
+}
+
+kafka_backpressure_stats kafka_producer_group::get_backpressure_stats() {
+    kafka_backpressure_stats stats;
+    for (auto shard : m_shards) {
+        kafka_backpressure_stats shard_stats = shard->get_backpressure_stats();
+        stats.blocked_producer_count += shard_stats.blocked_producer_count;
+        stats.total_blocked_count += shard_stats.total_blocked_count;
+        stats.total_blocked_time_us += shard_stats.total_blocked_time_us;
+    }
+    return stats;
+}
+
+int32_t kafka_producer_group::shard_count() const {
+    return (int32_t)m_shards.size();
+}
+
+kafka_producer* kafka_producer_group::shard(int32_t index) {
+    if (index < 0 || index >= (int32_t)m_shards.size()) {
+        return nullptr;
+    }
+
+    return m_shards[index];
+}
+
+void    kafka_producer_group::start() {
+    for (auto shard : m_shards) {
+        shard->start();
+    }
+}
+
+void    kafka_producer_group::stop() {
+    for (auto shard : m_shards) {
+        shard->stop();
+    }
+}
+
+void    kafka_producer_group::wait_for_stop() {
+    for (auto shard : m_shards) {
+        shard->wait_for_stop();
+    }
+}
+
+bool    kafka_producer_group::shutdown(int32_t timeout_ms, kafka_shutdown_report* report) {
+    // one after another, the last shards would get no time left to flush
+    std::vector<kafka_shutdown_report> reports(m_shards.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        threads.push_back(std::thread([&, i] {
+            m_shards[i]->shutdown(timeout_ms, &reports[i]);
+        }));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    kafka_shutdown_report total;
+    total.completed = true;
+    for (auto& shard_report : reports) {
+        total.completed = total.completed && shard_report.completed;
+        total.elapsed_ms = (std::max)(total.elapsed_ms, shard_report.elapsed_ms);
+        total.undelivered_count += shard_report.undelivered_count;
+        total.spilled_count += shard_report.spilled_count;
+    }
+
+    if (report) {
+        *report = total;
+    }
+
+    return total.completed;
+}
+
+kafka_producer* kafka_producer_group::route(const std::string* key) {
+    return m_shards[route_index(key)];
+}
+
+int32_t kafka_producer_group::route_index(const std::string* key) {
+    uint32_t shard_index = 0;
+    if (m_routing == shard_by_key && key) {
+        shard_index = shard_hash(key->c_str(), key->size());
+    }
+    else {
+        shard_index = current_thread_index();
+    }
+
+    return (int32_t)(shard_index % m_shards.size());
+}
+
+int32_t kafka_producer_group::group_topic_id(const std::string& topic_name) {
+    group_topic* topic = m_topics.get_or_create(topic_name, [this](const std::string& name) {
+        // called with the map locked
+        return new group_topic{ name, m_next_topic_id++ };
+    });
+    return topic->topic_id;
+}
+
+} // end namespace utility
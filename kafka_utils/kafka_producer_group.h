@@ -0,0 +1,132 @@
+﻿/**
+ * @brief kafka producer group
+ *
+ * N kafka_producer shards behind the produce_msg interface, 
+ * so that the enqueue of many threads does not contend on one librdkafka producer
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-27
+ */
+
+#ifndef __utility_common_kafka_producer_group_h__
+#define __utility_common_kafka_producer_group_h__
+
+#include "kafka_common.h"
+#include "kafka_producer.h"
+#include "kafka_producer_event_handler.h"
+#include "kafka_append_only_map.hpp"
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+
+namespace utility {
+
+/** how kafka_producer_group picks the shard of a message */
+enum kafka_shard_routing {
+    shard_by_key,       /** messages with the same key go to the same shard, keyless ones go by thread */
+    shard_by_thread,    /** each calling thread sticks to one shard */
+};
+
+class kafka_producer_group
+{
+protected:
+    class shard_event_handler;
+
+    struct group_topic {
+        std::string name;
+        int32_t     topic_id;
+    };
+
+    std::vector<kafka_producer*>        m_shards;
+    /** one per shard, forwards the shard's events to m_event_handler */
+    std::vector<shard_event_handler*>   m_shard_handlers;
+    kafka_shard_routing                 m_routing;
+    kafka_producer_event_handler*       m_event_handler;
+    /** shards which notified all brokers down and have delivered nothing since */
+    std::atomic<int32_t>                m_down_shard_count;
+    /** group wide ids of kafka_delivery_record::topic_id, each shard numbers its topics on its own */
+    kafka_append_only_map<std::string, group_topic> m_topics;
+    int32_t                             m_next_topic_id;
+    /** one limiter per topic shared by all the shards, so the configured limit holds whatever the routing */
+    std::map<std::string, kafka_topic_rate_limiter*>    m_rate_limiters;
+
+public:
+    kafka_producer_group(const kafka_producer_options& options, int32_t shard_count, 
+        int32_t work_thread_count_per_shard = 1, kafka_shard_routing routing = shard_by_key);
+    ~kafka_producer_group();
+
+    kafka_producer_group(const kafka_producer_group&) = delete;
+    kafka_producer_group& operator=(const kafka_producer_group&) = delete;
+
+public:
+    /** 
+     * the events of all the shards, called from all their threads;
+     * all brokers down is notified once until a shard delivers again, 
+     * the topic_id of the delivery records is a group wide id, see topic_name;
+     * on_produce_status is not aggregated: it is called with the raw statistics JSON of each shard, 
+     * told apart by their "name", so one interval gives shard_count documents;
+     * the group wide numbers are the ones of the get_* accessors below
+     */
+    void    set_event_handler(kafka_producer_event_handler* handler);
+    bool    produce_msg(const std::string& topic_name, const std::string& msg, const std::string* key, std::string* err_string);
+    bool    produce_msg(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, std::string* err_string);
+    bool    produce_msg_move(const std::string& topic_name, std::string&& msg, const std::string* key, std::string* err_string);
+    bool    produce_msg_move(const std::string& topic_name, int32_t partition, std::string&& msg, const std::string* key, std::string* err_string);
+    bool    produce_envelope_move(const std::string& topic_name, int32_t partition, std::string&& envelope, const std::string* key, std::string* err_string);
+    bool    produce_msg(const std::string& topic_name, int32_t partition, const char* payload, size_t len, 
+        kafka_producer::payload_policy policy, const std::string* key, std::string* err_string);
+    bool    produce_msg(const std::string& topic_name, int32_t partition, char* payload, size_t len, 
+        const kafka_producer::payload_deleter& deleter, const std::string* key, std::string* err_string);
+    kafka_produce_future produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key);
+    bool    produce_msg_async(const std::string& topic_name, int32_t partition, const std::string& msg, const std::string* key, 
+        const kafka_producer::delivery_callback& callback, std::string* err_string);
+
+    /** 
+     * with shard_by_key the records are split by the shard of their key, 
+     * each shard produces its part with a single librdkafka call
+     */
+    int32_t produce_batch(const std::string& topic_name, int32_t partition, std::vector<kafka_produce_record>& records, 
+        kafka_producer::payload_policy policy = kafka_producer::payload_copy);
+
+    int32_t partition_count(const std::string& topic_name);
+
+    /** name of the group wide kafka_delivery_record::topic_id */
+    std::string topic_name(int32_t topic_id);
+
+    /** aggregated over the shards, unlike on_produce_status */
+
+    /** sum of all the shards */
+    int32_t out_queue_len();
+    kafka_backpressure_stats get_backpressure_stats();
+
+    /** sum of all the shards, each shard spills to spill_dir + "_shard<index>" */
+    kafka_spill_stats get_spill_stats();
+
+    /** latency percentiles of all the shards' messages */
+    bool    get_topic_latency(const std::string& topic_name, kafka_latency_snapshot* snapshot, bool reset = false);
+    void    get_topic_latency(std::map<std::string, kafka_latency_snapshot>* snapshots, bool reset = false);
+    void    get_broker_latency(std::map<int32_t, kafka_latency_snapshot>* snapshots, bool reset = false);
+
+    /** the limiters are shared by all the shards */
+    bool    get_topic_rate_stats(const std::string& topic_name, kafka_topic_rate_stats* stats);
+    void    get_topic_rate_stats(std::map<std::string, kafka_topic_rate_stats>* stats);
+
+    int32_t shard_count() const;
+    kafka_producer* shard(int32_t index);
+    void    start();
+    void    stop();
+    void    wait_for_stop();
+
+    /** shuts the shards down in parallel, the report is the sum of all the shards */
+    bool    shutdown(int32_t timeout_ms, kafka_shutdown_report* report = nullptr);
+
+protected:
+    kafka_producer* route(const std::string* key);
+    int32_t route_index(const std::string* key);
+    int32_t group_topic_id(const std::string& topic_name);
+};
+
+} // end namespace utility
+
+#endif
@@ -0,0 +1,229 @@
+﻿/**
+ * @brief kafka rate limiter
+ *
+ * lock-free token buckets for the per-topic produce rate limits of kafka_producer,
+ * implemented as GCRA: a bucket is a single atomic "theoretical arrival time"
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-30
+ */
+
+#ifndef __utility_common_kafka_rate_limiter_hpp__
+#define __utility_common_kafka_rate_limiter_hpp__
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+namespace utility
+{
+
+/** what produce does when a topic is over its rate limit */
+enum kafka_rate_limit_policy {
+    rate_limit_reject,      /** fail at once with ERR__QUEUE_FULL */
+    rate_limit_delay,       /** wait for the tokens up to max_delay_ms, then fail */
+    rate_limit_spill,       /** write the message to the spill log, see kafka_producer_options::spill_dir; fail if it cannot be spilled */
+};
+
+struct kafka_topic_rate_limit {
+    double                      msgs_per_sec;       /** 0 for no limit */
+    double                      bytes_per_sec;      /** payload bytes, 0 for no limit */
+    /** bucket capacity, in ms worth of the rate */
+    int32_t                     burst_ms;
+    kafka_rate_limit_policy     policy;
+    int32_t                     max_delay_ms;
+
+    kafka_topic_rate_limit()
+        : msgs_per_sec(0)
+        , bytes_per_sec(0)
+        , burst_ms(1000)
+        , policy(rate_limit_reject)
+        , max_delay_ms(1000){
+    }
+};
+
+struct kafka_topic_rate_stats {
+    double      msg_tokens;         /** tokens left right now, negative while in debt */
+    double      byte_tokens;
+    int64_t     rejected_count;
+    int64_t     delayed_count;
+    int64_t     total_delay_time_us;
+    int64_t     spilled_count;
+
+    kafka_topic_rate_stats()
+        : msg_tokens(0)
+        , byte_tokens(0)
+        , rejected_count(0)
+        , delayed_count(0)
+        , total_delay_time_us(0)
+        , spilled_count(0){
+    }
+};
+
+class kafka_token_bucket
+{
+protected:
+    double                  m_interval_ns;      /** time one token takes to refill, 0 for unlimited */
+    int64_t                 m_tolerance_ns;     /** time the full bucket takes to refill */
+    std::atomic<int64_t>    m_tat;              /** when the bucket is full again */
+
+public:
+    kafka_token_bucket(double rate_per_sec, double burst) 
+        : m_interval_ns(rate_per_sec > 0 ? 1e9 / rate_per_sec : 0)
+        , m_tolerance_ns((int64_t)((std::max)(burst, 1.0) * m_interval_ns))
+        , m_tat(0){
+    }
+
+public:
+    bool    unlimited() const {
+        return m_interval_ns <= 0;
+    }
+
+    /** 
+     * take n tokens, returns 0 on success, or the ns to wait before they could be taken;
+     * a request bigger than the bucket passes when the bucket is full and leaves it in debt
+     */
+    int64_t try_acquire(int64_t n, int64_t now_ns) {
+        if (unlimited()) {
+            return 0;
+        }
+
+        int64_t cost = (int64_t)(n * m_interval_ns);
+        int64_t tat = m_tat.load(std::memory_order_relaxed);
+
+        while (true) {
+            int64_t new_tat = (std::max)(tat, now_ns) + cost;
+            if (new_tat - now_ns > m_tolerance_ns && tat > now_ns) {
+                return (tat - now_ns) + (std::min)(cost - m_tolerance_ns, (int64_t)0);
+            }
+
+            if (m_tat.compare_exchange_weak(tat, new_tat, std::memory_order_relaxed)) {
+                return 0;
+            }
+        }
+    }
+
+    /** give back tokens taken by try_acquire */
+    void    refund(int64_t n) {
+        if (!unlimited()) {
+            m_tat.fetch_sub((int64_t)(n * m_interval_ns), std::memory_order_relaxed);
+        }
+    }
+
+    double  tokens(int64_t now_ns) const {
+        if (unlimited()) {
+            return 0;
+        }
+
+        int64_t tat = (std::max)(m_tat.load(std::memory_order_relaxed), now_ns);
+        return (m_tolerance_ns - (tat - now_ns)) / m_interval_ns;
+    }
+};
+
+class kafka_topic_rate_limiter
+{
+protected:
+    kafka_topic_rate_limit  m_limit;
+    kafka_token_bucket      m_msg_bucket;
+    kafka_token_bucket      m_byte_bucket;
+    std::atomic<int64_t>    m_rejected_count;
+    std::atomic<int64_t>    m_delayed_count;
+    std::atomic<int64_t>    m_total_delay_time_us;
+    std::atomic<int64_t>    m_spilled_count;
+
+public:
+    kafka_topic_rate_limiter(const kafka_topic_rate_limit& limit)
+        : m_limit(limit)
+        , m_msg_bucket(limit.msgs_per_sec, limit.msgs_per_sec * limit.burst_ms / 1000.0)
+        , m_byte_bucket(limit.bytes_per_sec, limit.bytes_per_sec * limit.burst_ms / 1000.0)
+        , m_rejected_count(0)
+        , m_delayed_count(0)
+        , m_total_delay_time_us(0)
+        , m_spilled_count(0){
+    }
+
+public:
+    const kafka_topic_rate_limit& limit() const {
+        return m_limit;
+    }
+
+    /** take the tokens of msg_count messages of bytes in total, returns 0 or the ns to wait */
+    int64_t try_acquire(int64_t msg_count, int64_t bytes) {
+        int64_t now_ns = now();
+
+        int64_t wait_ns = m_msg_bucket.try_acquire(msg_count, now_ns);
+        if (wait_ns > 0) {
+            return wait_ns;
+        }
+
+        wait_ns = m_byte_bucket.try_acquire(bytes, now_ns);
+        if (wait_ns > 0) {
+            m_msg_bucket.refund(msg_count);
+        }
+
+        return wait_ns;
+    }
+
+    /** try_acquire, waiting up to max_delay_ms if the policy is rate_limit_delay; false if over the limit */
+    bool    acquire(int64_t msg_count, int64_t bytes) {
+        int64_t wait_ns = try_acquire(msg_count, bytes);
+        if (wait_ns == 0) {
+            return true;
+        }
+
+        if (m_limit.policy != rate_limit_delay) {
+            return false;
+        }
+
+        int64_t start_ns = now();
+        int64_t deadline_ns = start_ns + (int64_t)m_limit.max_delay_ms * 1000000;
+        ++m_delayed_count;
+
+        while (wait_ns > 0 && now() + wait_ns <= deadline_ns) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(wait_ns));
+            wait_ns = try_acquire(msg_count, bytes);
+        }
+
+        m_total_delay_time_us += (now() - start_ns) / 1000;
+        return wait_ns == 0;
+    }
+
+    /** give back the tokens of messages that were acquired but not produced */
+    void    refund(int64_t msg_count, int64_t bytes) {
+        m_msg_bucket.refund(msg_count);
+        m_byte_bucket.refund(bytes);
+    }
+
+    void    on_rejected(int64_t msg_count) {
+        m_rejected_count += msg_count;
+    }
+
+    void    on_spilled() {
+        ++m_spilled_count;
+    }
+
+    kafka_topic_rate_stats stats() const {
+        int64_t now_ns = now();
+
+        kafka_topic_rate_stats stats;
+        stats.msg_tokens = m_msg_bucket.tokens(now_ns);
+        stats.byte_tokens = m_byte_bucket.tokens(now_ns);
+        stats.rejected_count = m_rejected_count.load();
+        stats.delayed_count = m_delayed_count.load();
+        stats.total_delay_time_us = m_total_delay_time_us.load();
+        stats.spilled_count = m_spilled_count.load();
+        return stats;
+    }
+
+protected:
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+}
+
+#endif
@@ -2,6 +2,8 @@
 #include "kafka_consumer_event_handler.h"
 #include "kafka_thread_pool.hpp"
 #include "kafka_ip_utils.hpp"
+#include <chrono>
+#include <algorithm>
 
 namespace utility
 {
@@ -12,7 +14,8 @@ kafka_simple_consumer::kafka_simple_consumer(const kafka_simple_consumer_options
     , m_global_conf(nullptr)
     , m_default_topic_conf(nullptr)
     , m_work_thread_pool(nullptr)
-    , m_total_partition_count(0) {
+    , m_total_partition_count(0)
+    , m_consuming(false) {
 
     m_global_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_GLOBAL);
     m_default_topic_conf = RdKafka::Conf::create(RdKafka::Conf::CONF_TOPIC);
@@ -55,6 +58,8 @@ kafka_simple_consumer::~kafka_simple_consumer() {
         m_work_thread_pool = nullptr;
     }
 
+    stop_consume();
+
     if (m_consumer) {
         delete m_consumer;
         m_consumer = nullptr;
@@ -82,6 +87,7 @@ void    kafka_simple_consumer::set_event_handler(kafka_consumer_event_handler* h
 
 void    kafka_simple_consumer::start() {
     m_consumer->start(m_topic, m_options.partition, m_options.start_offset);
+    m_consuming = true;
     m_work_thread_pool->start();
 }
 
@@ -93,6 +99,83 @@ void    kafka_simple_consumer::wait_for_stop() {
     return m_work_thread_pool->join_all();
 }
 
+bool    kafka_simple_consumer::shutdown(int32_t timeout_ms, kafka_shutdown_report* report) {
+    auto start_time = std::chrono::steady_clock::now();
+    auto deadline = start_time + std::chrono::milliseconds((std::max)(timeout_ms, 0));
+    kafka_shutdown_report result;
+
+    // the work threads see the stop within one consume slice
+    stop();
+    wait_for_stop();
+
+    // the messages fetched already are handled on this thread until the deadline,
+    // the rest are dropped by the stop of the fetcher, their offsets were not stored
+    bool drained = !m_consuming.load();
+    while (!drained && std::chrono::steady_clock::now() < deadline) {
+        RdKafka::Message* msg = m_consumer->consume(m_topic, m_options.partition, 0);
+        drained = msg->err() == RdKafka::ERR__TIMED_OUT;
+        if (!drained) {
+            msg_consume(msg, NULL);
+        }
+        delete msg;
+    }
+
+    result.commit_error = stop_consume();
+    result.elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start_time).count();
+    result.completed = drained && result.commit_error == RdKafka::ERR_NO_ERROR;
+
+    if (report) {
+        *report = result;
+    }
+
+    return result.completed;
+}
+
+bool    kafka_simple_consumer::seek(int64_t offset, int32_t timeout_ms, std::string* err_string) {
+    RdKafka::ErrorCode err = m_consumer->seek(m_topic, m_options.partition, offset, timeout_ms);
+    if (err != RdKafka::ERR_NO_ERROR) {
+        if (err_string) {
+            *err_string = RdKafka::err2str(err);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+bool    kafka_simple_consumer::seek_to_time(int64_t timestamp_ms, int32_t timeout_ms, std::string* err_string) {
+    // offsetsForTimes takes the timestamp in the offset field
+    std::vector<RdKafka::TopicPartition*> offsets;
+    offsets.push_back(RdKafka::TopicPartition::create(m_options.topic_name, m_options.partition, timestamp_ms));
+
+    RdKafka::ErrorCode err = m_consumer->offsetsForTimes(offsets, timeout_ms);
+    if (err == RdKafka::ERR_NO_ERROR) {
+        err = offsets[0]->err();
+    }
+
+    int64_t offset = offsets[0]->offset();
+    RdKafka::TopicPartition::destroy(offsets);
+
+    if (err != RdKafka::ERR_NO_ERROR) {
+        if (err_string) {
+            *err_string = RdKafka::err2str(err);
+        }
+        return false;
+    }
+
+    // no message at or after the timestamp
+    return seek(offset < 0 ? RdKafka::Topic::OFFSET_END : offset, timeout_ms, err_string);
+}
+
+RdKafka::ErrorCode kafka_simple_consumer::stop_consume() {
+    if (!m_consuming.exchange(false)) {
+        return RdKafka::ERR_NO_ERROR;
+    }
+
+    return m_consumer->stop(m_topic, m_options.partition);
+}
+
 void    kafka_simple_consumer::event_cb(RdKafka::Event &event) {
     switch (event.type())
     {
@@ -220,7 +303,8 @@ bool    kafka_simple_consumer::msg_consume(RdKafka::Message* message, void* opaq
 }
 
 bool    kafka_simple_consumer::tick_func() {
-    RdKafka::Message *msg = m_consumer->consume(m_topic, m_options.partition, 2000);
+    // a message wakes the consume at once, the short wait only bounds how long a stop waits for it
+    RdKafka::Message *msg = m_consumer->consume(m_topic, m_options.partition, 100);
     bool ret = msg_consume(msg, NULL);
     delete msg;
 
@@ -13,6 +13,7 @@
 #include "kafka_common.h"
 #include <string>
 #include <vector>
+#include <atomic>
 #include <rdkafkacpp.h>
 
 namespace utility
@@ -50,6 +51,8 @@ protected:
     RdKafka::Consumer*              m_consumer;
     RdKafka::Topic*                 m_topic;
     int32_t                         m_total_partition_count;
+    /** between the start and the stop of the fetcher */
+    std::atomic<bool>               m_consuming;
 
 public:
     kafka_simple_consumer(const kafka_simple_consumer_options& options, int32_t work_thread_count = 1);
@@ -61,6 +64,18 @@ public:
     void    stop();
     void    wait_for_stop();
 
+    /** 
+     * stops the work threads, handles the messages fetched already until timeout_ms,
+     * then stops the fetcher, which commits the stored offset; true if nothing fetched was left and the stop succeeded
+     */
+    bool    shutdown(int32_t timeout_ms, kafka_shutdown_report* report = nullptr);
+
+    /** moves the consume position of the partition while consuming */
+    bool    seek(int64_t offset, int32_t timeout_ms, std::string* err_string);
+
+    /** seeks to the first message at or after timestamp_ms (ms since epoch), to the end if there is none */
+    bool    seek_to_time(int64_t timestamp_ms, int32_t timeout_ms, std::string* err_string);
+
 protected:
     /** implement the interface from EventCb */
     void    event_cb(RdKafka::Event &event) override;
@@ -68,6 +83,7 @@ protected:
 protected:
     bool    msg_consume(RdKafka::Message* message, void* opaque);
     bool    tick_func();
+    RdKafka::ErrorCode  stop_consume();
 
 };
 
@@ -0,0 +1,577 @@
+﻿#include "kafka_spill_log.h"
+#include "kafka_hash.hpp"
+#include <string.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+namespace utility
+{
+
+/**
+ * segment file layout:
+ * header  : magic(4) version(4) size(8) read_offset(8) reserved(8)
+ * records : body_len(4) crc32c_of_body(4) body, padded to 8 bytes, a zero body_len ends the segment
+ * body    : partition(4) topic_len(2) flags(2) key_len(4) topic key payload
+ */
+static const uint32_t spill_segment_magic = 0x4c50534b;     // "KSPL"
+static const uint32_t spill_segment_version = 1;
+static const int64_t spill_header_size = 32;
+static const int64_t spill_read_offset_pos = 16;
+static const int64_t spill_record_header_size = 8;
+static const int64_t spill_body_fixed_size = 12;
+static const uint16_t spill_flag_has_key = 0x1;
+static const uint16_t spill_flag_envelope = 0x2;
+static const char* spill_segment_suffix = ".spill";
+static const char* spill_corrupt_suffix = ".corrupt";
+
+static inline int64_t spill_align(int64_t size) {
+    return (size + 7) & ~(int64_t)7;
+}
+
+static inline uint32_t spill_crc(const char* data, size_t len) {
+    return crc32c_hash()(data, len);
+}
+
+kafka_spill_log::segment::segment()
+    : id(0)
+    , size(0)
+    , base(nullptr)
+    , write_offset(spill_header_size)
+    , read_offset(spill_header_size)
+    , pending_count(0)
+    , sealed(false)
+#ifdef _WIN32
+    , file_handle(INVALID_HANDLE_VALUE)
+    , mapping_handle(nullptr)
+#else
+    , fd(-1)
+#endif
+{
+}
+
+kafka_spill_log::kafka_spill_log(const std::string& dir, int64_t segment_size, int64_t max_bytes)
+    : m_dir(dir)
+    , m_segment_size((std::max)(segment_size, (int64_t)64 * 1024))
+    , m_max_bytes(max_bytes)
+    , m_next_segment_id(0)
+    , m_disk_bytes(0)
+    , m_pending_bytes(0)
+    , m_pending_count(0)
+    , m_peek_next_offset(-1)
+    , m_spilled_count(0)
+    , m_replayed_count(0)
+    , m_dropped_count(0)
+    , m_quarantined_count(0){
+}
+
+kafka_spill_log::~kafka_spill_log() {
+    // the segments stay on disk, they are replayed by the next run
+    for (auto seg : m_segments) {
+        unmap_segment(seg);
+        delete seg;
+    }
+    m_segments.clear();
+}
+
+bool kafka_spill_log::open(std::string* err_string) {
+    std::lock_guard<std::mutex> locker(m_mtx);
+
+    std::vector<int64_t> ids;
+    auto collect = [&](const std::string& file_name) {
+        size_t suffix_len = strlen(spill_segment_suffix);
+        if (file_name.size() <= suffix_len || 
+            file_name.compare(file_name.size() - suffix_len, suffix_len, spill_segment_suffix) != 0) {
+            return;
+        }
+
+        std::string id_str = file_name.substr(0, file_name.size() - suffix_len);
+        if (id_str.find_first_not_of("0123456789") != std::string::npos) {
+            return;
+        }
+
+        ids.push_back(std::stoll(id_str));
+    };
+
+#ifdef _WIN32
+    if (!CreateDirectoryA(m_dir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        if (err_string) {
+            *err_string = "create spill dir " + m_dir + " failed";
+        }
+        return false;
+    }
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE find_handle = FindFirstFileA((m_dir + "\\*" + spill_segment_suffix).c_str(), &find_data);
+    if (find_handle != INVALID_HANDLE_VALUE) {
+        do {
+            collect(find_data.cFileName);
+        } while (FindNextFileA(find_handle, &find_data));
+        FindClose(find_handle);
+    }
+#else
+    if (mkdir(m_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        if (err_string) {
+            *err_string = "create spill dir " + m_dir + " failed: " + strerror(errno);
+        }
+        return false;
+    }
+
+    DIR* dir = opendir(m_dir.c_str());
+    if (!dir) {
+        if (err_string) {
+            *err_string = "open spill dir " + m_dir + " failed: " + strerror(errno);
+        }
+        return false;
+    }
+
+    while (struct dirent* entry = readdir(dir)) {
+        collect(entry->d_name);
+    }
+    closedir(dir);
+#endif
+
+    std::sort(ids.begin(), ids.end());
+
+    for (auto id : ids) {
+        segment* seg = new segment();
+        seg->id = id;
+        seg->path = segment_path(id);
+        seg->sealed = true;
+
+        if (!recover_segment(seg)) {
+            // not a segment of ours, or corrupted at the header; leave the file alone
+            unmap_segment(seg);
+            delete seg;
+            continue;
+        }
+
+        unmap_segment(seg);
+        m_next_segment_id = id + 1;
+
+        if (seg->read_offset >= seg->write_offset) {
+            remove_segment(seg);
+            continue;
+        }
+
+        m_disk_bytes += seg->size;
+        m_segments.push_back(seg);
+    }
+
+    return true;
+}
+
+bool kafka_spill_log::append(const std::string& topic_name, int32_t partition,
+    const char* key, size_t key_len, const char* payload, size_t len, bool envelope) {
+    if (topic_name.size() > 0xffff) {
+        ++m_dropped_count;
+        return false;
+    }
+
+    int64_t body_len = spill_body_fixed_size + (int64_t)topic_name.size() + (key ? (int64_t)key_len : 0) + (int64_t)len;
+    int64_t record_size = spill_align(spill_record_header_size + body_len);
+
+    std::lock_guard<std::mutex> locker(m_mtx);
+
+    segment* seg = m_segments.empty() ? nullptr : m_segments.back();
+    // keep room for the zero body_len that ends the segment
+    if (!seg || seg->sealed || seg->write_offset + record_size + spill_record_header_size > seg->size) {
+        int64_t size = (std::max)(m_segment_size, spill_header_size + record_size + spill_record_header_size);
+        if (m_max_bytes > 0 && m_disk_bytes + size > m_max_bytes) {
+            ++m_dropped_count;
+            return false;
+        }
+
+        segment* new_seg = create_segment(m_next_segment_id, size);
+        if (!new_seg) {
+            ++m_dropped_count;
+            return false;
+        }
+
+        ++m_next_segment_id;
+        m_disk_bytes += size;
+
+        if (seg && !seg->sealed) {
+            seg->sealed = true;
+
+            // the full write segment is mapped again when the reader gets to it
+            if (m_segments.size() > 1) {
+                unmap_segment(seg);
+            }
+        }
+
+        m_segments.push_back(new_seg);
+        seg = new_seg;
+    }
+
+    char* record = seg->base + seg->write_offset;
+    char* body = record + spill_record_header_size;
+
+    int32_t partition_value = partition;
+    uint16_t topic_len = (uint16_t)topic_name.size();
+    uint16_t flags = (key ? spill_flag_has_key : 0) | (envelope ? spill_flag_envelope : 0);
+    uint32_t key_len_value = key ? (uint32_t)key_len : 0;
+
+    char* pos = body;
+    memcpy(pos, &partition_value, 4); pos += 4;
+    memcpy(pos, &topic_len, 2); pos += 2;
+    memcpy(pos, &flags, 2); pos += 2;
+    memcpy(pos, &key_len_value, 4); pos += 4;
+    memcpy(pos, topic_name.data(), topic_len); pos += topic_len;
+    if (key_len_value > 0) {
+        memcpy(pos, key, key_len_value); pos += key_len_value;
+    }
+    if (len > 0) {
+        memcpy(pos, payload, len);
+    }
+
+    uint32_t crc = spill_crc(body, (size_t)body_len);
+    memcpy(record + 4, &crc, 4);
+    // the length goes last, a record is not visible to the recovery scan until it is complete
+    uint32_t body_len_value = (uint32_t)body_len;
+    memcpy(record, &body_len_value, 4);
+
+    seg->write_offset += record_size;
+    ++seg->pending_count;
+    m_pending_bytes += record_size;
+    ++m_pending_count;
+    ++m_spilled_count;
+
+    return true;
+}
+
+bool kafka_spill_log::peek(kafka_spill_record* record) {
+    std::lock_guard<std::mutex> locker(m_mtx);
+
+    while (!m_segments.empty()) {
+        segment* seg = m_segments.front();
+
+        if (seg->read_offset < seg->write_offset) {
+            if (!seg->base && !map_segment(seg, false)) {
+                if (!seg->sealed) {
+                    return false;
+                }
+
+                // it would fail again on every peek and hold back the segments behind it
+                m_segments.pop_front();
+                quarantine_segment(seg);
+                continue;
+            }
+
+            const char* header = seg->base + seg->read_offset;
+            const char* body = header + spill_record_header_size;
+
+            uint32_t body_len = 0;
+            memcpy(&body_len, header, 4);
+
+            int32_t partition = 0;
+            uint16_t topic_len = 0;
+            uint16_t flags = 0;
+            uint32_t key_len = 0;
+            memcpy(&partition, body, 4);
+            memcpy(&topic_len, body + 4, 2);
+            memcpy(&flags, body + 6, 2);
+            memcpy(&key_len, body + 8, 4);
+
+            const char* pos = body + spill_body_fixed_size;
+            record->topic_name.assign(pos, topic_len);
+            pos += topic_len;
+            record->partition = partition;
+            record->has_key = (flags & spill_flag_has_key) != 0;
+            record->envelope = (flags & spill_flag_envelope) != 0;
+            record->key.assign(pos, key_len);
+            pos += key_len;
+            record->payload.assign(pos, body + body_len - pos);
+
+            m_peek_next_offset = seg->read_offset + spill_align(spill_record_header_size + body_len);
+            return true;
+        }
+
+        if (!seg->sealed) {
+            // the write segment, nothing more to read
+            return false;
+        }
+
+        m_segments.pop_front();
+        m_disk_bytes -= seg->size;
+        remove_segment(seg);
+    }
+
+    return false;
+}
+
+void kafka_spill_log::pop(bool replayed) {
+    std::lock_guard<std::mutex> locker(m_mtx);
+
+    if (m_segments.empty() || m_peek_next_offset < 0) {
+        return;
+    }
+
+    segment* seg = m_segments.front();
+    m_pending_bytes -= m_peek_next_offset - seg->read_offset;
+    --m_pending_count;
+    seg->read_offset = m_peek_next_offset;
+    --seg->pending_count;
+    m_peek_next_offset = -1;
+    memcpy(seg->base + spill_read_offset_pos, &seg->read_offset, 8);
+
+    if (replayed) {
+        ++m_replayed_count;
+    }
+    else {
+        ++m_dropped_count;
+    }
+
+    if (seg->sealed && seg->read_offset >= seg->write_offset) {
+        m_segments.pop_front();
+        m_disk_bytes -= seg->size;
+        remove_segment(seg);
+    }
+}
+
+bool kafka_spill_log::empty() {
+    std::lock_guard<std::mutex> locker(m_mtx);
+    return m_pending_count == 0;
+}
+
+kafka_spill_stats kafka_spill_log::get_stats() {
+    std::lock_guard<std::mutex> locker(m_mtx);
+
+    kafka_spill_stats stats;
+    stats.spilled_count = m_spilled_count;
+    stats.replayed_count = m_replayed_count;
+    stats.dropped_count = m_dropped_count;
+    stats.pending_count = m_pending_count;
+    stats.pending_bytes = m_pending_bytes;
+    stats.segment_count = (int32_t)m_segments.size();
+    stats.quarantined_count = m_quarantined_count;
+    return stats;
+}
+
+std::vector<std::string> kafka_spill_log::take_errors() {
+    std::lock_guard<std::mutex> locker(m_mtx);
+
+    std::vector<std::string> errors;
+    errors.swap(m_errors);
+    return errors;
+}
+
+kafka_spill_log::segment* kafka_spill_log::create_segment(int64_t id, int64_t size) {
+    segment* seg = new segment();
+    seg->id = id;
+    seg->path = segment_path(id);
+    seg->size = size;
+
+    if (!map_segment(seg, true)) {
+        delete seg;
+        return nullptr;
+    }
+
+    // the file is zero filled, so the records end right after the header
+    memcpy(seg->base, &spill_segment_magic, 4);
+    memcpy(seg->base + 4, &spill_segment_version, 4);
+    memcpy(seg->base + 8, &seg->size, 8);
+    memcpy(seg->base + spill_read_offset_pos, &seg->read_offset, 8);
+    return seg;
+}
+
+bool kafka_spill_log::recover_segment(segment* seg) {
+    if (!map_segment(seg, false) || seg->size < spill_header_size) {
+        return false;
+    }
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    int64_t read_offset = 0;
+    memcpy(&magic, seg->base, 4);
+    memcpy(&version, seg->base + 4, 4);
+    memcpy(&read_offset, seg->base + spill_read_offset_pos, 8);
+
+    if (magic != spill_segment_magic || version != spill_segment_version || 
+        read_offset < spill_header_size || read_offset > seg->size) {
+        return false;
+    }
+
+    // find the end of the valid records, a torn write at the tail is dropped
+    int64_t offset = read_offset;
+    while (offset + spill_record_header_size <= seg->size) {
+        uint32_t body_len = 0;
+        uint32_t crc = 0;
+        memcpy(&body_len, seg->base + offset, 4);
+        memcpy(&crc, seg->base + offset + 4, 4);
+
+        int64_t record_size = spill_align(spill_record_header_size + body_len);
+        if (body_len < (uint32_t)spill_body_fixed_size || offset + record_size > seg->size ||
+            spill_crc(seg->base + offset + spill_record_header_size, body_len) != crc) {
+            break;
+        }
+
+        offset += record_size;
+        ++seg->pending_count;
+        m_pending_bytes += record_size;
+        ++m_pending_count;
+    }
+
+    seg->read_offset = read_offset;
+    seg->write_offset = offset;
+    return true;
+}
+
+bool kafka_spill_log::map_segment(segment* seg, bool create) {
+#ifdef _WIN32
+    seg->file_handle = CreateFileA(seg->path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (seg->file_handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    if (!create) {
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(seg->file_handle, &file_size)) {
+            unmap_segment(seg);
+            return false;
+        }
+        seg->size = file_size.QuadPart;
+    }
+
+    // the mapping extends a new file to size, zero filled
+    seg->mapping_handle = CreateFileMappingA(seg->file_handle, NULL, PAGE_READWRITE,
+        (DWORD)((uint64_t)seg->size >> 32), (DWORD)((uint64_t)seg->size & 0xffffffff), NULL);
+    if (!seg->mapping_handle) {
+        unmap_segment(seg);
+        return false;
+    }
+
+    seg->base = (char*)MapViewOfFile(seg->mapping_handle, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)seg->size);
+    if (!seg->base) {
+        unmap_segment(seg);
+        return false;
+    }
+#else
+    seg->fd = ::open(seg->path.c_str(), create ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+    if (seg->fd < 0) {
+        return false;
+    }
+
+    if (create) {
+        if (ftruncate(seg->fd, (off_t)seg->size) != 0) {
+            unmap_segment(seg);
+            ::unlink(seg->path.c_str());
+            return false;
+        }
+    }
+    else {
+        struct stat st;
+        if (fstat(seg->fd, &st) != 0) {
+            unmap_segment(seg);
+            return false;
+        }
+        seg->size = (int64_t)st.st_size;
+    }
+
+    void* base = mmap(nullptr, (size_t)seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (base == MAP_FAILED) {
+        unmap_segment(seg);
+        return false;
+    }
+    seg->base = (char*)base;
+#endif
+
+    return true;
+}
+
+void kafka_spill_log::unmap_segment(segment* seg) {
+#ifdef _WIN32
+    if (seg->base) {
+        UnmapViewOfFile(seg->base);
+        seg->base = nullptr;
+    }
+
+    if (seg->mapping_handle) {
+        CloseHandle(seg->mapping_handle);
+        seg->mapping_handle = nullptr;
+    }
+
+    if (seg->file_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(seg->file_handle);
+        seg->file_handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (seg->base) {
+        munmap(seg->base, (size_t)seg->size);
+        seg->base = nullptr;
+    }
+
+    if (seg->fd >= 0) {
+        ::close(seg->fd);
+        seg->fd = -1;
+    }
+#endif
+}
+
+void kafka_spill_log::remove_segment(segment* seg) {
+    unmap_segment(seg);
+
+#ifdef _WIN32
+    DeleteFileA(seg->path.c_str());
+#else
+    ::unlink(seg->path.c_str());
+#endif
+
+    delete seg;
+}
+
+void kafka_spill_log::quarantine_segment(segment* seg) {
+#ifdef _WIN32
+    std::string reason = "error " + std::to_string(GetLastError());
+#else
+    std::string reason = strerror(errno);
+#endif
+    unmap_segment(seg);
+
+    // renamed out of the *.spill names, so the next open does not load it again; kept for inspection
+    std::string corrupt_path = seg->path.substr(0, seg->path.size() - strlen(spill_segment_suffix)) + spill_corrupt_suffix;
+#ifdef _WIN32
+    bool moved = MoveFileExA(seg->path.c_str(), corrupt_path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool moved = ::rename(seg->path.c_str(), corrupt_path.c_str()) == 0;
+#endif
+
+    m_pending_bytes -= seg->write_offset - seg->read_offset;
+    m_pending_count -= seg->pending_count;
+    m_dropped_count += seg->pending_count;
+    m_disk_bytes -= seg->size;
+    ++m_quarantined_count;
+
+    m_errors.push_back("map spill segment " + seg->path + " failed(" + reason + "), " + 
+        std::to_string(seg->pending_count) + " messages dropped" + (moved ? ", moved to " + corrupt_path : std::string()));
+
+    delete seg;
+}
+
+std::string kafka_spill_log::segment_path(int64_t id) {
+    // zero padded, so the names sort in id order
+    std::string name = std::to_string(id);
+    if (name.size() < 20) {
+        name.insert(0, 20 - name.size(), '0');
+    }
+
+#ifdef _WIN32
+    return m_dir + "\\" + name + spill_segment_suffix;
+#else
+    return m_dir + "/" + name + spill_segment_suffix;
+#endif
+}
+
+} // end namespace utility
@@ -0,0 +1,143 @@
+﻿/**
+ * @brief kafka spill log
+ *
+ * append-only log of messages on local disk, made of memory-mapped segment files,
+ * used by kafka_producer to keep the messages it could not hand to the brokers;
+ * written data lives in the page cache, so it survives a crash of the process(not of the host),
+ * the segments left in the directory are replayed after restart
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-29
+ */
+
+#ifndef __utility_common_kafka_spill_log_h__
+#define __utility_common_kafka_spill_log_h__
+
+#include "kafka_common.h"
+#include <string>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+namespace utility {
+
+/** one message read back from the spill log */
+struct kafka_spill_record {
+    std::string topic_name;
+    int32_t     partition;
+    bool        has_key;
+    std::string key;
+    std::string payload;
+    /** a kafka_envelope, replayed with its header */
+    bool        envelope;
+
+    kafka_spill_record() : partition(-1), has_key(false), envelope(false) {
+    }
+};
+
+struct kafka_spill_stats {
+    int64_t     spilled_count;      /** messages written to disk */
+    int64_t     replayed_count;     /** messages produced again from disk */
+    int64_t     dropped_count;      /** messages lost: disk full, rejected by the brokers on replay, or in a quarantined segment */
+    int64_t     pending_count;      /** messages on disk waiting for replay */
+    int64_t     pending_bytes;
+    int32_t     segment_count;
+    int32_t     quarantined_count;  /** segments that could not be read back, renamed to *.corrupt and skipped */
+
+    kafka_spill_stats()
+        : spilled_count(0)
+        , replayed_count(0)
+        , dropped_count(0)
+        , pending_count(0)
+        , pending_bytes(0)
+        , segment_count(0)
+        , quarantined_count(0){
+    }
+};
+
+class kafka_spill_log
+{
+protected:
+    struct segment {
+        int64_t     id;
+        std::string path;
+        int64_t     size;
+        char*       base;           /** nullptr while not mapped */
+        int64_t     write_offset;
+        int64_t     read_offset;
+        /** records between read_offset and write_offset */
+        int64_t     pending_count;
+        /** left by a previous run, only read */
+        bool        sealed;
+#ifdef _WIN32
+        void*       file_handle;
+        void*       mapping_handle;
+#else
+        int         fd;
+#endif
+
+        segment();
+    };
+
+protected:
+    std::string             m_dir;
+    int64_t                 m_segment_size;
+    int64_t                 m_max_bytes;
+    std::mutex              m_mtx;
+    /** oldest first, the last one is written */
+    std::deque<segment*>    m_segments;
+    int64_t                 m_next_segment_id;
+    int64_t                 m_disk_bytes;
+    int64_t                 m_pending_bytes;
+    int64_t                 m_pending_count;
+    /** read offset after the record returned by the last peek */
+    int64_t                 m_peek_next_offset;
+    std::atomic<int64_t>    m_spilled_count;
+    std::atomic<int64_t>    m_replayed_count;
+    std::atomic<int64_t>    m_dropped_count;
+    int32_t                 m_quarantined_count;
+    /** why the segments were quarantined, taken by take_errors */
+    std::vector<std::string>    m_errors;
+
+public:
+    /** max_bytes caps the disk usage, 0 for no limit */
+    kafka_spill_log(const std::string& dir, int64_t segment_size, int64_t max_bytes);
+    ~kafka_spill_log();
+
+    kafka_spill_log(const kafka_spill_log&) = delete;
+    kafka_spill_log& operator=(const kafka_spill_log&) = delete;
+
+public:
+    /** create the directory and load the segments a previous run left in it */
+    bool    open(std::string* err_string);
+
+    /** append one message, key is nullptr for keyless messages; false if the disk is full */
+    bool    append(const std::string& topic_name, int32_t partition, 
+        const char* key, size_t key_len, const char* payload, size_t len, bool envelope = false);
+
+    /** read the oldest message without consuming it, false if the log is empty; only one reader at a time */
+    bool    peek(kafka_spill_record* record);
+
+    /** consume the message returned by the last peek */
+    void    pop(bool replayed);
+
+    bool    empty();
+    kafka_spill_stats get_stats();
+
+    /** the errors since the last call, e.g. a segment peek could not map and quarantined */
+    std::vector<std::string> take_errors();
+
+protected:
+    segment*    create_segment(int64_t id, int64_t size);
+    bool        map_segment(segment* seg, bool create);
+    void        unmap_segment(segment* seg);
+    void        remove_segment(segment* seg);
+    void        quarantine_segment(segment* seg);
+    bool        recover_segment(segment* seg);
+    std::string segment_path(int64_t id);
+};
+
+} // end namespace utility
+
+#endif
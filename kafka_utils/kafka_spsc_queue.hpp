@@ -0,0 +1,110 @@
+﻿/**
+ * @brief kafka spsc queue
+ *
+ * bounded lock-free single producer single consumer ring buffer,
+ * feeds the dispatch workers of kafka_consumer from its poll thread
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-06-03
+ */
+
+#ifndef __utility_common_kafka_spsc_queue_hpp__
+#define __utility_common_kafka_spsc_queue_hpp__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+namespace utility
+{
+
+template<typename T>
+class kafka_spsc_queue
+{
+protected:
+    enum {
+        cache_line_size = 64,
+    };
+
+    std::vector<T>          m_buffer;
+    size_t                  m_mask;
+
+    /** the two sides are padded apart, so they do not share a cache line */
+    char                    m_pad0[cache_line_size];
+
+    /** written by the consumer only */
+    std::atomic<size_t>     m_head;
+    /** consumer's copy of m_tail, saves reading the producer's cache line */
+    size_t                  m_cached_tail;
+    char                    m_pad1[cache_line_size];
+
+    /** written by the producer only */
+    std::atomic<size_t>     m_tail;
+    /** producer's copy of m_head */
+    size_t                  m_cached_head;
+    char                    m_pad2[cache_line_size];
+
+public:
+    /** capacity is rounded up to a power of two */
+    explicit kafka_spsc_queue(size_t capacity)
+        : m_head(0)
+        , m_cached_tail(0)
+        , m_tail(0)
+        , m_cached_head(0){
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+
+        m_buffer.resize(size);
+        m_mask = size - 1;
+    }
+
+    kafka_spsc_queue(const kafka_spsc_queue&) = delete;
+    kafka_spsc_queue& operator=(const kafka_spsc_queue&) = delete;
+
+public:
+    /** producer side, false if the queue is full */
+    bool    try_push(const T& value) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cached_head > m_mask) {
+            m_cached_head = m_head.load(std::memory_order_acquire);
+            if (tail - m_cached_head > m_mask) {
+                return false;
+            }
+        }
+
+        m_buffer[tail & m_mask] = value;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** consumer side, false if the queue is empty */
+    bool    try_pop(T* value) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cached_tail) {
+            m_cached_tail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cached_tail) {
+                return false;
+            }
+        }
+
+        *value = m_buffer[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** exact from the consumer side, a hint from anywhere else */
+    bool    empty() const {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+
+    size_t  capacity() const {
+        return m_mask + 1;
+    }
+};
+
+}
+
+#endif
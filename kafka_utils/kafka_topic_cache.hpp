@@ -0,0 +1,129 @@
+﻿/**
+ * @brief kafka topic cache
+ *
+ * per producer cache of the RdKafka::Topic handles, keyed by topic name
+ *
+ * @author  :   yandaren1220@126.com
+ * @date    :   2019-05-20
+ */
+
+#ifndef __utility_common_kafka_topic_cache_hpp__
+#define __utility_common_kafka_topic_cache_hpp__
+
+#include "kafka_common.h"
+#include "kafka_append_only_map.hpp"
+#include "kafka_latency_histogram.hpp"
+#include "kafka_rate_limiter.hpp"
+#include <rdkafkacpp.h>
+#include <string>
+#include <atomic>
+#include <functional>
+
+namespace utility
+{
+
+struct kafka_topic_entry
+{
+    std::string         name;
+    int32_t             topic_id;       /** index in the cache, stable for the producer lifetime */
+    RdKafka::Topic*     topic;
+
+    /** cached metadata, -1 if not fetched yet */
+    std::atomic<int32_t>    partition_count;
+    /** steady clock time in ms the metadata should be refreshed at, 0 means refresh at once */
+    std::atomic<int64_t>    metadata_expire_time_ms;
+
+    /** produce to delivery report latency of the successfully delivered messages */
+    kafka_latency_histogram latency;
+
+    /** produce rate limit of the topic, not owned, nullptr if the topic is not limited */
+    kafka_topic_rate_limiter*   rate_limiter;
+
+    kafka_topic_entry(const std::string& topic_name, int32_t id, RdKafka::Topic* rk_topic)
+        : name(topic_name)
+        , topic_id(id)
+        , topic(rk_topic)
+        , partition_count(-1)
+        , metadata_expire_time_ms(0)
+        , rate_limiter(nullptr){
+    }
+
+    ~kafka_topic_entry() {
+        if (topic) {
+            delete topic;
+            topic = nullptr;
+        }
+    }
+};
+
+class kafka_topic_cache
+{
+public:
+    typedef std::function<RdKafka::Topic*(const std::string& topic_name)> topic_creator;
+    /** sets up a new entry before it is visible to the other threads */
+    typedef std::function<void(kafka_topic_entry* entry)> entry_initializer;
+
+protected:
+    struct topic_ref {
+        kafka_topic_entry*  entry;
+    };
+
+    kafka_append_only_map<std::string, kafka_topic_entry>       m_topics;
+    /** the delivery reports carry the RdKafka::Topic of the message */
+    kafka_append_only_map<const RdKafka::Topic*, topic_ref>     m_topics_by_handle;
+    int32_t                                                     m_next_topic_id;
+
+public:
+    kafka_topic_cache() : m_next_topic_id(0) {
+    }
+
+public:
+    /** lock-free lookup, nullptr if the topic is not cached yet */
+    kafka_topic_entry*  find(const std::string& topic_name) const {
+        return m_topics.find(topic_name);
+    }
+
+    /** lookup the topic, create its handle by creator on the first use */
+    kafka_topic_entry*  get(const std::string& topic_name, const topic_creator& creator, const entry_initializer& initializer = nullptr) {
+        kafka_topic_entry* entry = m_topics.get_or_create(topic_name, [&](const std::string& name) -> kafka_topic_entry* {
+            RdKafka::Topic* topic = creator(name);
+            if (!topic) {
+                return nullptr;
+            }
+
+            // called with the map locked
+            kafka_topic_entry* new_entry = new kafka_topic_entry(name, m_next_topic_id++, topic);
+            if (initializer) {
+                initializer(new_entry);
+            }
+            return new_entry;
+        });
+
+        if (entry && !m_topics_by_handle.find(entry->topic)) {
+            m_topics_by_handle.get_or_create(entry->topic, [entry](const RdKafka::Topic*) {
+                return new topic_ref{ entry };
+            });
+        }
+
+        return entry;
+    }
+
+    /** lock-free lookup by the topic handle, e.g. rd_kafka_topic_opaque() of a delivery report's rkt */
+    kafka_topic_entry*  find(const RdKafka::Topic* topic) const {
+        topic_ref* ref = m_topics_by_handle.find(topic);
+        return ref ? ref->entry : nullptr;
+    }
+
+    /** lookup by topic id */
+    kafka_topic_entry*  get(int32_t topic_id) {
+        return m_topics.at(topic_id);
+    }
+
+    std::vector<kafka_topic_entry*> entries() {
+        return m_topics.values();
+    }
+};
+
+} // end namespace utility
+
+#endif